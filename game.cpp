@@ -1,8 +1,29 @@
 #include <iostream>
 #include <cmath>
 #include <fstream>
+#include <cstring>
+#include <ctime>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <deque>
+#include <climits>
+#include <cerrno>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <ao/ao.h>
 #include <mpg123.h>
 
@@ -16,6 +37,144 @@
 #define BITS 8
 using namespace std;
 
+/**************************
+ * Allocation tracking    *
+ **************************/
+
+/* Built with -DALLOC_TRACKING (make alloc), every operator new and malloc is counted and the
+   main loop reports each frame that allocated once the game is past its warm-up frames.
+   Unless NDEBUG is set the report breaks the frame down by call site. -DALLOC_ABORT also
+   aborts on such a frame, so a soak run stops at the first allocation in steady state.
+   Only the thread running the frame loop is counted; the loader, audio and progress threads
+   allocate on their own time */
+#ifdef ALLOC_TRACKING
+#include <dlfcn.h>
+#include <new>
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void __libc_free(void*);
+
+#define ALLOC_WARMUP_FRAMES 120
+#define ALLOC_SITES 256         // open-addressed by caller address
+
+struct AllocSite {
+    void *caller;
+    unsigned long count;
+    unsigned long bytes;
+};
+typedef struct AllocSite AllocSite;
+
+atomic<unsigned long> allocCount(0), allocBytes(0), freeCount(0);
+AllocSite allocSites[ALLOC_SITES];
+atomic_flag allocSitesLock = ATOMIC_FLAG_INIT;
+thread_local bool allocFrameThread = false;     // set by the first allocFrameBegin
+
+void noteAlloc(size_t size, void *caller){
+    if(!allocFrameThread)
+        return;
+    allocCount++;
+    allocBytes += size;
+#ifndef NDEBUG
+    while(allocSitesLock.test_and_set(memory_order_acquire))
+        ;
+    unsigned h = ((uintptr_t)caller >> 4) % ALLOC_SITES;
+    for(int probe=0;probe<ALLOC_SITES;probe++,h=(h+1)%ALLOC_SITES){
+        if(allocSites[h].caller!=caller && allocSites[h].caller!=NULL)
+            continue;
+        allocSites[h].caller = caller;
+        allocSites[h].count++;
+        allocSites[h].bytes += size;
+        break;
+    }
+    allocSitesLock.clear(memory_order_release);
+#endif
+}
+
+extern "C" void* malloc(size_t size){
+    noteAlloc(size, __builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size){
+    noteAlloc(n*size, __builtin_return_address(0));
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void *p, size_t size){
+    noteAlloc(size, __builtin_return_address(0));
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p){
+    if(p && allocFrameThread)
+        freeCount++;
+    __libc_free(p);
+}
+
+void* operator new(size_t size){
+    noteAlloc(size, __builtin_return_address(0));
+    void *p = __libc_malloc(size ? size : 1);
+    if(!p)
+        throw bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size){
+    noteAlloc(size, __builtin_return_address(0));
+    void *p = __libc_malloc(size ? size : 1);
+    if(!p)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+void allocFrameBegin(){
+    allocFrameThread = true;
+    allocCount = 0;
+    allocBytes = 0;
+    freeCount = 0;
+#ifndef NDEBUG
+    while(allocSitesLock.test_and_set(memory_order_acquire))
+        ;
+    memset(allocSites, 0, sizeof allocSites);
+    allocSitesLock.clear(memory_order_release);
+#endif
+}
+
+/* Reports the allocations made since allocFrameBegin; nothing here may allocate */
+void allocFrameEnd(unsigned long frame){
+    unsigned long count = allocCount, bytes = allocBytes, frees = freeCount;
+    if(frame < ALLOC_WARMUP_FRAMES || (count==0 && frees==0))
+        return;
+    fprintf(stderr, "frame %lu: %lu allocations, %lu bytes, %lu frees\n", frame, count, bytes, frees);
+#ifndef NDEBUG
+    for(int i=0;i<ALLOC_SITES;i++){
+        if(allocSites[i].caller==NULL)
+            continue;
+        Dl_info info;
+        if(dladdr(allocSites[i].caller, &info) && info.dli_sname)
+            fprintf(stderr, "    %lu x %lu bytes from %s+%#lx\n", allocSites[i].count, allocSites[i].bytes,
+                    info.dli_sname, (unsigned long)((char*)allocSites[i].caller - (char*)info.dli_saddr));
+        else
+            fprintf(stderr, "    %lu x %lu bytes from %p\n", allocSites[i].count, allocSites[i].bytes, allocSites[i].caller);
+    }
+#endif
+#ifdef ALLOC_ABORT
+    if(count)
+        abort();
+#endif
+}
+#else
+void allocFrameBegin(){}
+void allocFrameEnd(unsigned long){}
+#endif
+
 struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
@@ -24,6 +183,9 @@ struct VAO {
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int FirstVertex;                // where the vertices start in the buffer, for glDrawArrays
+    int FirstIndex, NumIndices;     // a range of a baked level's index buffer when NumIndices > 0
+    bool Shared;                    // draws part of buffers another VAO owns, freeMesh leaves them
 };
 typedef struct VAO VAO;
 
@@ -35,26 +197,48 @@ struct COLOR {
 typedef struct COLOR COLOR;
 
 
-struct Sprite {
-    string name;
-    COLOR color;
-    float x,y,z;
-    VAO* object;
-    int status;
-    float height,width,depth;
-    float x_change,y_change,z_change;
-    float angle; //Current Angle (Actual rotated angle of the object)
-    float radius;
-    int fixed;
-    float flag ; //Value from 0 to 1
-    int isRotating;
-    int direction; //0 for clockwise and 1 for anticlockwise for animation
-    float remAngle; //the remaining angle to finish animation
-    int isMovingAnim;
-    int dx;
-    int dy;
+/* Render entities: one structure of arrays per archetype. Index i of every array in a
+   store is the same entity, so a per-frame pass reads only the arrays it needs, front to back.
+   Entities are found by index, never by name */
+struct TileStore {
+    vector<glm::vec3> pos;
+    vector<VAO*> mesh;
+    vector<unsigned char> type;  // CELL_*
+    vector<float> drop;          // how far a broken tile has fallen
+    vector<float> tilt;          // bridge angle in degrees, 0 when closed
+    vector<signed char> hinge;   // -1 or 1: the side a bridge folds up on, 0 for other tiles
+    vector<signed char> gate;    // gate bit that lowers the bridge
+    vector<int> cell;            // grid cell of the level
+};
+typedef struct TileStore TileStore;
+
+struct SwitchStore {
+    vector<glm::vec3> pos;
+    vector<VAO*> mesh;
+};
+typedef struct SwitchStore SwitchStore;
+
+/* The seven-segment displays of the HUD */
+enum { HUD_POINT1=0, HUD_POINT2, HUD_POINT3, HUD_SEC1, HUD_SEC2, HUD_MIN1, HUD_MIN2, HUD_DIGITS };
+
+struct HudStore {
+    vector<glm::vec3> pos;
+    vector<VAO*> mesh;
+    vector<signed char> digit;      // HUD_*, -1 for marks that are always lit
+    vector<unsigned char> segment;  // 0-6 for seg1-seg7
+};
+typedef struct HudStore HudStore;
+
+/* Lit segments of each decimal digit, bit i for seg(i+1) */
+static const unsigned char sevenSegment[10] = { 0x3f, 0x06, 0x5b, 0x4f, 0x66, 0x6d, 0x7d, 0x07, 0x7f, 0x6f };
+
+struct BlockStore {
+    vector<glm::vec3> pos;           // where the mesh was built
+    vector<glm::vec3> centre;        // centre of the block at rest in its cell
+    vector<unsigned char> direction; // STANDING, LYING_X or LYING_Z
+    vector<VAO*> mesh;
 };
-typedef struct Sprite Sprite;
+typedef struct BlockStore BlockStore;
 
 
 struct GLMatrices {
@@ -66,19 +250,13 @@ struct GLMatrices {
 
 struct GLMatrices Matrices1;
 
-map <string, Sprite> tiles;
-map <string, Sprite> ltiles;
-map <string, Sprite> block;
-map <string, Sprite> switches;
-map <string, Sprite> point1;
-map <string, Sprite> point2;
-map <string, Sprite> point3;
-map <string, Sprite> sec1;
-map <string, Sprite> sec2;
-map <string, Sprite> min1;
-map <string, Sprite> min2;
-map <string, Sprite> label;
-map <string, Sprite> endlabel;
+TileStore tiles[2];     // per level: the tiles that move
+vector<int> tileOfCell[2];     // per level: index in tiles[] of the tile on each cell, -1 for none
+vector<VAO*> tileBatches[2];   // per level: every other tile, baked into shared meshes
+vector<VAO*> tileBuffers[2];   // per level: the buffers the moving tiles draw their ranges of
+SwitchStore switches[2];
+HudStore hud;
+BlockStore blocks;      // just the player's block
 
 
 glm::mat4 rotateblock = glm::mat4(1.0f);
@@ -173,21 +351,77 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+void saveSessionReplay();
+void closeProgress();
+void audio_close();
+double wallClock();
+void unloadLevels();
+void needLevel(int lvl);
+
 void quit(GLFWwindow *window)
 {
+    saveSessionReplay();
+    closeProgress();
+    audio_close();
+    unloadLevels();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
 
 
+int headless =0;
+
+/* Bump allocators. levelArena[l] holds the CPU side of the meshes of level l and is dropped
+   as a whole when the level is released; gameArena holds the HUD and block meshes, which last
+   the whole game. frameArena holds upload staging and other scratch and is reset at the
+   start of every frame */
+struct Arena {
+    char *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+    const char *name;
+};
+typedef struct Arena Arena;
+
+static char levelArenaMemory[2][1<<23], gameArenaMemory[1<<16], frameArenaMemory[1<<20];
+Arena levelArena[2] = { { levelArenaMemory[0], sizeof levelArenaMemory[0], 0, 0, "level 0" },
+                        { levelArenaMemory[1], sizeof levelArenaMemory[1], 0, 0, "level 1" } };
+Arena gameArena = { gameArenaMemory, sizeof gameArenaMemory, 0, 0, "game" };
+Arena frameArena = { frameArenaMemory, sizeof frameArenaMemory, 0, 0, "frame" };
+Arena *meshArena = &gameArena;      // where create3DObject puts its VAO structs
+
+void* arenaAlloc(Arena &a, size_t size, size_t align=16){
+    size_t start = (a.used + align-1) & ~(align-1);
+    if(start+size > a.size){
+        fprintf(stderr, "%s arena: out of memory (%zu of %zu bytes used, %zu asked)\n", a.name, a.used, a.size, size);
+        exit(EXIT_FAILURE);
+    }
+    a.used = start+size;
+    a.peak = max(a.peak, a.used);
+    return a.base+start;
+}
+
+void arenaReset(Arena &a){
+    a.used = 0;
+}
+
 /* Generate VAO, VBOs and return VAO handle */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
-    struct VAO* vao = new struct VAO;
+    struct VAO* vao = (struct VAO*) arenaAlloc(*meshArena, sizeof(struct VAO));
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->FirstVertex = vao->FirstIndex = vao->NumIndices = 0;
+    vao->Shared = false;
+
+    // No GL context in the headless tools, keep the sprite but skip the upload
+    if(headless){
+        vao->VertexArrayID = vao->VertexBuffer = vao->ColorBuffer = 0;
+        return vao;
+    }
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
@@ -221,19 +455,6 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
-{
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for(int i=0; i<numVertices;i++){
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
-    }
-
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
-}
-
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
@@ -254,7 +475,10 @@ void draw3DObject (struct VAO* vao)
     glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
 
     // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    if(vao->NumIndices)
+        glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_INT, (void*)(vao->FirstIndex*sizeof(GLuint)));
+    else
+        glDrawArrays(vao->PrimitiveMode, vao->FirstVertex, vao->NumVertices);
 }
 
 /**************************
@@ -279,6 +503,8 @@ int key_pressed_up=0;
 int key_pressed_down=0;
 int key_pressed_left=0;
 int key_pressed_right=0;
+int key_pressed_undo=0;
+int key_pressed_redo=0;
 int key_pressed_right_alt=0;
 int key_pressed_right_control=0;
 
@@ -300,9 +526,6 @@ float target_z = 0;
 
 
 mpg123_handle *mh;
-unsigned char *buffer;
-size_t buffer_size;
-size_t done;
 int err;
 
 int driver;
@@ -312,17 +535,289 @@ ao_sample_format format;
 int channels, encoding;
 long rate;
 
+/* The music runs on two threads of its own. A decoder fills a ring of PCM, and an output
+   thread hands the ring to libao, whose ao_play blocks until the device takes the data.
+   The ring has one producer and one consumer, so neither waits on a lock, and the render
+   loop does not touch either library after audio_init.
+
+   The song is decoded once: on the first run into memory, then kept next to the MP3 as
+   AUDIO_CACHE_FILE, which later runs map instead. After that the decoder only copies
+   PCM into the ring, and the loop is the copy going on from the first byte. mpg123 runs
+   gapless, so the encoder's padding is cut and the last sample meets the first.
+
+   A song too long to keep is decoded from the file on every loop. Its first
+   AUDIO_LOOP_HEAD bytes are kept; at the end they are spliced in from memory while the
+   decoder seeks, through the frame index mpg123_scan built, to the sample after them */
+#define AUDIO_RING (1<<17)      // bytes of PCM, about 0.7 s of 44.1 kHz 16-bit stereo
+#define AUDIO_CHUNK 4096        // bytes per ao_play
+#define AUDIO_DECODE 16384      // bytes per mpg123_read while decoding the whole song
+#define AUDIO_CACHE_MAX (64<<20)
+#define AUDIO_LOOP_HEAD (1<<16) // bytes of the start spliced in at each loop of a streamed song
+#define AUDIO_FILE "./background.mp3"
+#define AUDIO_CACHE_FILE "./background.pcm"
+#define AUDIO_CACHE_MAGIC "BLXA"
+#define AUDIO_CACHE_VERSION 2     // 2: decoded gapless
+
+/* Ahead of the PCM in the cache file; the MP3's size and time tell a stale cache */
+struct PcmCacheHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t rate, channels, encoding;
+    uint32_t reserved;
+    uint64_t mp3Size;
+    int64_t mp3Time;
+    uint64_t bytes;
+};
+typedef struct PcmCacheHeader PcmCacheHeader;
+
+struct AudioStream {
+    unsigned char ring[AUDIO_RING];
+    atomic<size_t> head, tail;          // bytes decoded, bytes played
+    atomic<bool> running;
+    atomic<bool> ended;                 // the decoder has nothing more to give
+    atomic<unsigned long> underruns;    // times the output found the ring dry
+    unsigned long chunks;
+    unsigned long loops;
+    thread decoder, output;
+
+    const unsigned char *track;         // the whole song as PCM, NULL while it streams
+    size_t trackBytes;
+    vector<unsigned char> decoded;      // the track when it was decoded this run
+    void *map;                          // the cache file when it was mapped
+    size_t mapSize;
+    unsigned char loopHead[AUDIO_LOOP_HEAD];    // the start of a streamed song
+
+    ~AudioStream(){                     // exit() with the music still playing
+        running = false;
+        if(decoder.joinable())
+            decoder.join();
+        if(output.joinable())
+            output.join();
+    }
+};
+typedef struct AudioStream AudioStream;
+
+AudioStream audio;
+
+/* Copy up to n bytes into the free part of the ring without waiting; returns how many */
+static size_t pushPcm(const unsigned char *src, size_t n){
+    size_t head = audio.head.load(memory_order_relaxed);
+    n = min(n, AUDIO_RING - (head - audio.tail.load(memory_order_acquire)));
+    size_t first = min(n, AUDIO_RING - head % AUDIO_RING);
+    memcpy(audio.ring + head % AUDIO_RING, src, first);
+    memcpy(audio.ring, src + first, n - first);
+    audio.head.store(head + n, memory_order_release);
+    return n;
+}
+
+/* Copy all n bytes, waiting for the output thread to make room; false if stopped first */
+static bool pushAllPcm(const unsigned char *src, size_t n){
+    while(n && audio.running){
+        size_t done = pushPcm(src, n);
+        src += done;
+        n -= done;
+        if(n)
+            this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    return n==0;
+}
+
+/* Map the cache when it was made from this MP3 in this format */
+static bool mapPcmCache(){
+    struct stat mp3, st;
+    if(stat(AUDIO_FILE, &mp3)<0)
+        return false;
+    int fd = open(AUDIO_CACHE_FILE, O_RDONLY);
+    if(fd<0)
+        return false;
+    if(fstat(fd, &st)<0 || (size_t)st.st_size<sizeof(PcmCacheHeader)){
+        close(fd);
+        return false;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base==MAP_FAILED)
+        return false;
+    const PcmCacheHeader &h = *(const PcmCacheHeader*)base;
+    if(memcmp(h.magic, AUDIO_CACHE_MAGIC, 4)!=0 || h.version!=AUDIO_CACHE_VERSION || h.rate!=rate ||
+       h.channels!=channels || h.encoding!=encoding || h.mp3Size!=(uint64_t)mp3.st_size ||
+       h.mp3Time!=(int64_t)mp3.st_mtime || sizeof h + h.bytes!=(uint64_t)st.st_size){
+        munmap(base, st.st_size);
+        return false;
+    }
+    audio.map = base;
+    audio.mapSize = st.st_size;
+    audio.track = (const unsigned char*)base + sizeof h;
+    audio.trackBytes = h.bytes;
+    return true;
+}
+
+/* Written to a temporary file and renamed, so a half-written cache is never mapped */
+static void writePcmCache(const unsigned char *pcm, size_t bytes){
+    struct stat mp3;
+    if(stat(AUDIO_FILE, &mp3)<0)
+        return;
+    PcmCacheHeader h = {};
+    memcpy(h.magic, AUDIO_CACHE_MAGIC, 4);
+    h.version = AUDIO_CACHE_VERSION;
+    h.rate = rate;
+    h.channels = channels;
+    h.encoding = encoding;
+    h.mp3Size = mp3.st_size;
+    h.mp3Time = mp3.st_mtime;
+    h.bytes = bytes;
+    FILE *out = fopen(AUDIO_CACHE_FILE ".tmp", "wb");
+    if(!out)
+        return;
+    bool ok = fwrite(&h, sizeof h, 1, out)==1 && fwrite(pcm, 1, bytes, out)==bytes;
+    ok = (fclose(out)==0) && ok;
+    if(!ok || rename(AUDIO_CACHE_FILE ".tmp", AUDIO_CACHE_FILE)!=0){
+        remove(AUDIO_CACHE_FILE ".tmp");
+        fprintf(stderr, "%s: cannot write the audio cache\n", AUDIO_CACHE_FILE);
+    }
+}
+
+/* Decode the whole song into memory as fast as mpg123 goes, feeding the ring on the way so
+   the music starts at once. 'fed' is how far the ring got. False, having decoded nothing,
+   when the song is too long to keep */
+static bool decodeTrack(size_t &fed){
+    mpg123_scan(mh);
+    off_t samples = mpg123_length(mh);
+    size_t bytes = (size_t)samples*channels*mpg123_encsize(encoding);
+    if(samples<=0 || bytes>AUDIO_CACHE_MAX)
+        return false;
+
+    double t0 = wallClock();
+    audio.decoded.resize(bytes);
+    size_t used = 0;
+    fed = 0;
+    while(audio.running && used<bytes){
+        size_t done = 0;
+        int ret = mpg123_read(mh, &audio.decoded[used], min(bytes-used, (size_t)AUDIO_DECODE), &done);
+        used += done;
+        fed += pushPcm(&audio.decoded[fed], used-fed);
+        if(!done && ret!=MPG123_OK)
+            break;
+    }
+    if(!audio.running)
+        return true;
+    audio.decoded.resize(used);
+    audio.track = used ? &audio.decoded[0] : NULL;
+    audio.trackBytes = used;
+    if(used){
+        writePcmCache(audio.track, used);
+        printf("audio: decoded %s once, %.1f MB in %.0f ms, kept in %s\n",
+               AUDIO_FILE, used/1e6, (wallClock()-t0)*1000.0, AUDIO_CACHE_FILE);
+    }
+    return true;
+}
+
+/* For a song too long to keep: decode straight into the free part of the ring. The loop
+   head goes in from memory at every end while mpg123 seeks past it */
+static void streamTrack(){
+    size_t headBytes = 0, frame = channels*mpg123_encsize(encoding);
+    bool ended = false;
+    while(audio.running && headBytes<AUDIO_LOOP_HEAD){
+        size_t done = 0;
+        int ret = mpg123_read(mh, audio.loopHead + headBytes, AUDIO_LOOP_HEAD - headBytes, &done);
+        headBytes += done;
+        if(!done && ret!=MPG123_OK){
+            ended = true;       // the whole song fits in the head
+            break;
+        }
+    }
+    headBytes -= headBytes % frame;
+    if(headBytes==0 || !pushAllPcm(audio.loopHead, headBytes))
+        return;
+    if(ended){
+        while(pushAllPcm(audio.loopHead, headBytes))
+            audio.loops++;
+        return;
+    }
+
+    bool spliced = false;
+    while(audio.running){
+        size_t head = audio.head.load(memory_order_relaxed);
+        size_t space = AUDIO_RING - (head - audio.tail.load(memory_order_acquire));
+        size_t run = min(space, AUDIO_RING - head % AUDIO_RING);
+        if(run<AUDIO_CHUNK){
+            this_thread::sleep_for(chrono::milliseconds(5));
+            continue;
+        }
+        size_t done = 0;
+        int ret = mpg123_read(mh, audio.ring + head % AUDIO_RING, run, &done);
+        if(done){
+            audio.head.store(head + done, memory_order_release);
+            spliced = false;
+        }
+        else if(ret!=MPG123_OK){
+            if(spliced)         // nothing after the head even from the top
+                break;
+            mpg123_seek(mh, headBytes/frame, SEEK_SET);
+            if(!pushAllPcm(audio.loopHead, headBytes))
+                break;
+            audio.loops++;
+            spliced = true;
+        }
+    }
+}
+
+/* Producer: get the song as PCM once, then copy it round and round into the ring */
+static void audioDecoder(){
+    size_t pos = 0;
+    if(!audio.track && !decodeTrack(pos)){
+        streamTrack();
+        audio.ended = true;
+        return;
+    }
+    while(audio.running && audio.trackBytes){
+        if(pos==audio.trackBytes)
+            pos = 0;
+        size_t n = pushPcm(audio.track + pos, min(audio.trackBytes - pos, (size_t)AUDIO_DECODE));
+        pos += n;
+        audio.loops += (pos==audio.trackBytes);
+        if(n==0)
+            this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    audio.ended = true;
+}
+
+/* Consumer: play what the decoder left, counting each time it falls behind */
+static void audioOutput(){
+    /* half a ring of head start before the first chunk */
+    while(audio.running && !audio.ended && audio.head.load(memory_order_acquire) < AUDIO_RING/2)
+        this_thread::sleep_for(chrono::milliseconds(2));
+    bool dry = false;
+    while(audio.running){
+        size_t tail = audio.tail.load(memory_order_relaxed);
+        size_t avail = audio.head.load(memory_order_acquire) - tail;
+        if(avail==0){
+            if(audio.ended)
+                break;
+            if(!dry)
+                audio.underruns++;
+            dry = true;
+            this_thread::sleep_for(chrono::milliseconds(1));
+            continue;
+        }
+        dry = false;
+        size_t n = min(min(avail, (size_t)AUDIO_CHUNK), AUDIO_RING - tail % AUDIO_RING);
+        ao_play(dev, (char*) audio.ring + tail % AUDIO_RING, n);
+        audio.tail.store(tail + n, memory_order_release);
+        audio.chunks++;
+    }
+}
+
 void audio_init() {
     /* initializations */
     ao_initialize();
     driver = ao_default_driver_id();
     mpg123_init();
     mh = mpg123_new(NULL, &err);
-    buffer_size = 2500;
-    buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
 
     /* open the file and get the decoding format */
-    mpg123_open(mh, "./background.mp3");
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_GAPLESS, 0);   // no encoder padding at the loop point
+    mpg123_open(mh, AUDIO_FILE);
     mpg123_getformat(mh, &rate, &channels, &encoding);
 
     /* set the output format and open the output device */
@@ -332,23 +827,46 @@ void audio_init() {
     format.byte_format = AO_FMT_NATIVE;
     format.matrix = 0;
     dev = ao_open_live(driver, &format, NULL);
-}
+    if(!dev){
+        fprintf(stderr, "audio: no output device, the music is off\n");
+        return;
+    }
 
-void audio_play() {
-    /* decode and play */
-    if (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
-        ao_play(dev, (char*) buffer, done);
-    else mpg123_seek(mh, 0, SEEK_SET);
+    if(mapPcmCache())
+        printf("audio: playing %s, no decoding\n", AUDIO_CACHE_FILE);
+    audio.head = audio.tail = 0;
+    audio.underruns = 0;
+    audio.chunks = 0;
+    audio.loops = 0;
+    audio.ended = false;
+    audio.running = true;
+    audio.decoder = thread(audioDecoder);
+    audio.output = thread(audioOutput);
 }
 
 void audio_close() {
-    /* clean up */
-    free(buffer);
-    ao_close(dev);
+    /* stop the threads, then clean up */
+    audio.running = false;
+    if(audio.decoder.joinable())
+        audio.decoder.join();
+    if(audio.output.joinable()){
+        audio.output.join();
+        printf("audio: %lu underruns in %lu chunks, %lu loops\n", (unsigned long)audio.underruns, audio.chunks, audio.loops);
+    }
+    if(audio.map)
+        munmap(audio.map, audio.mapSize);
+    vector<unsigned char>().swap(audio.decoded);
+    audio.map = NULL;
+    audio.track = NULL;
+    audio.trackBytes = 0;
+    if(dev)
+        ao_close(dev);
     mpg123_close(mh);
     mpg123_delete(mh);
     mpg123_exit();
     ao_shutdown();
+    dev = NULL;
+    mh = NULL;
 }
 
 
@@ -397,6 +915,12 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods){
                 key_pressed_F =0;
                 key_pressed_B =0;
                 break;
+            case GLFW_KEY_U:
+                key_pressed_undo =1;
+                break;
+            case GLFW_KEY_R:
+                key_pressed_redo =1;
+                break;
             case GLFW_KEY_RIGHT_ALT:
                 key_pressed_right_alt=0;
                 break;
@@ -515,134 +1039,45 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     Matrices.projection = glm::perspective(fov,(float)fbwidth/(float)fbheight, 0.1f, 5000.0f);
 }
 
-void createCube(string name,COLOR top,COLOR bottom,COLOR right,COLOR left,COLOR far,COLOR near,float x, float y ,float z,float width,float height,float depth,string component){
+/* Corners of the 12 triangles of a box, two per face in the order far, near, left, right,
+   top, bottom */
+static const signed char cubeCorners[36][3] = {
+    {-1,-1,-1}, {-1,1,-1}, {1,1,-1},   {1,1,-1}, {1,-1,-1}, {-1,-1,-1},
+    {-1,-1,1}, {-1,1,1}, {1,1,1},      {1,1,1}, {1,-1,1}, {-1,-1,1},
+    {-1,1,1}, {-1,1,-1}, {-1,-1,1},    {-1,-1,1}, {-1,-1,-1}, {-1,1,-1},
+    {1,1,1}, {1,-1,1}, {1,1,-1},       {1,1,-1}, {1,-1,-1}, {1,-1,1},
+    {-1,1,1}, {-1,1,-1}, {1,1,1},      {1,1,1}, {1,1,-1}, {-1,1,-1},
+    {-1,-1,1}, {-1,-1,-1}, {1,-1,1},   {1,-1,1}, {1,-1,-1}, {-1,-1,-1}
+};
 
+/* Writes the 36 vertices and colours of a width x height x depth box centred on 'at';
+   faces[] is far, near, left, right, top, bottom */
+void cubeGeometry(GLfloat *vertex, GLfloat *color, glm::vec3 at, float width, float height, float depth, const COLOR faces[6]){
     float w=width/2,h=height/2,d=depth/2;
-    GLfloat vertex_buffer_data []={
-        -w,-h,-d,
-        -w,h,-d,
-        w,h,-d,
-
-        w,h,-d,
-        w,-h,-d,
-        -w,-h,-d,
-
-        -w,-h,d,
-        -w,h,d,
-        w,h,d,
-
-        w,h,d,
-        w,-h,d,
-        -w,-h,d,
-
-        -w,h,d,
-        -w,h,-d,
-        -w,-h,d,
-
-        -w,-h,d,
-        -w,-h,-d,
-        -w,h,-d,
-
-        w,h,d,
-        w,-h,d,
-        w,h,-d,
-
-        w,h,-d,
-        w,-h,-d,
-        w,-h,d,
-
-        -w,h,d,
-        -w,h,-d,
-        w,h,d,
-
-        w,h,d,
-        w,h,-d,
-        -w,h,-d,
-
-        -w,-h,d,
-        -w,-h,-d,
-        w,-h,d,
-
-        w,-h,d,
-        w,-h,-d,
-        -w,-h,-d        
-    };
+    for(int i=0;i<36;i++){
+        vertex[3*i] = at.x + cubeCorners[i][0]*w;
+        vertex[3*i+1] = at.y + cubeCorners[i][1]*h;
+        vertex[3*i+2] = at.z + cubeCorners[i][2]*d;
+        color[3*i] = faces[i/6].r;
+        color[3*i+1] = faces[i/6].g;
+        color[3*i+2] = faces[i/6].b;
+    }
+}
 
+/* The player's block; returns its index in the block store */
+int createCube(COLOR top,COLOR bottom,COLOR right,COLOR left,COLOR far,COLOR near,float x, float y ,float z,float width,float height,float depth){
 
-    GLfloat color_buffer_data [] = {
-        far.r,far.g,far.b,
-        far.r,far.g,far.b,
-        far.r,far.g,far.b,
-        
-        far.r,far.g,far.b,
-        far.r,far.g,far.b,
-        far.r,far.g,far.b,
-
-        near.r,near.g,near.b,
-        near.r,near.g,near.b,
-        near.r,near.g,near.b,
-
-        near.r,near.g,near.b,
-        near.r,near.g,near.b,
-        near.r,near.g,near.b,
-
-        left.r,left.g,left.b,
-        left.r,left.g,left.b,
-        left.r,left.g,left.b,
-
-        left.r,left.g,left.b,
-        left.r,left.g,left.b,
-        left.r,left.g,left.b,
-
-        right.r,right.g,right.b,
-        right.r,right.g,right.b,
-        right.r,right.g,right.b,
-
-        right.r,right.g,right.b,
-        right.r,right.g,right.b,
-        right.r,right.g,right.b,
-
-        top.r,top.g,top.b,
-        top.r,top.g,top.b,
-        top.r,top.g,top.b,
-
-        top.r,top.g,top.b,
-        top.r,top.g,top.b,
-        top.r,top.g,top.b,
-
-        bottom.r,bottom.g,bottom.b,
-        bottom.r,bottom.g,bottom.b,
-        bottom.r,bottom.g,bottom.b,
-
-        bottom.r,bottom.g,bottom.b,
-        bottom.r,bottom.g,bottom.b,
-        bottom.r,bottom.g,bottom.b
-    };
+    COLOR faces[6] = { far, near, left, right, top, bottom };
+    GLfloat vertex_buffer_data[108], color_buffer_data[108];
+    cubeGeometry(vertex_buffer_data, color_buffer_data, glm::vec3(0,0,0), width, height, depth, faces);
 
     VAO *cube = create3DObject(GL_TRIANGLES,36,vertex_buffer_data,color_buffer_data,GL_FILL);
-    Sprite vishsprite = {};
-    vishsprite.color = top;
-    vishsprite.name = name;
-    vishsprite.object = cube;
-    vishsprite.x=x;
-    vishsprite.y=y;
-    vishsprite.z=z;
-    vishsprite.height=height;
-    vishsprite.width=width;
-    vishsprite.depth=depth;
-    vishsprite.status=1;
-    vishsprite.x_change=x;
-    vishsprite.y_change=y;
-    vishsprite.z_change=z;
-    vishsprite.fixed=0;
-    vishsprite.flag=0;
-
-    if(component=="tiles")
-        tiles[name]=vishsprite;
-    else if(component=="ltiles")
-        ltiles[name]=vishsprite;
-    else if(component=="block")
-        block[name]=vishsprite;
+
+    blocks.pos.push_back(glm::vec3(x,y,z));
+    blocks.centre.push_back(glm::vec3(x,y,z));
+    blocks.direction.push_back(0);
+    blocks.mesh.push_back(cube);
+    return blocks.mesh.size()-1;
 }
 
 void createRectangle1(string name, COLOR colorA, COLOR colorB, COLOR colorC, COLOR colorD, float x, float y, float height, float width, string component){
@@ -670,45 +1105,21 @@ void createRectangle1(string name, COLOR colorA, COLOR colorB, COLOR colorC, COL
 
     // create3DObject creates and returns a handle to a VAO that can be used later
     VAO *rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-    Sprite vishsprite = {};
-    vishsprite.color = colorA;
-    vishsprite.name = name;
-    vishsprite.object = rectangle;
-    vishsprite.x=x;
-    vishsprite.y=y;
-    vishsprite.height=height;
-    vishsprite.width=width;
-    vishsprite.status=1;
-    vishsprite.fixed=0;
-    vishsprite.angle=launch_angle;
-    vishsprite.radius=(sqrt(height*height+width*width))/2;
-    vishsprite.flag=0;
-
-    if(component=="block")
-        block[name]=vishsprite;
-    else if(component=="point1")
-        point1[name]=vishsprite;
-    else if(component=="point2")
-        point2[name]=vishsprite;
-    else if(component=="point3")
-        point3[name]=vishsprite;
-    else if(component=="sec1")
-        sec1[name]=vishsprite;
-    else if(component=="sec2")
-        sec2[name]=vishsprite;
-    else if(component=="min1")
-        min1[name]=vishsprite;
-    else if(component=="min2")
-        min2[name]=vishsprite;
-    else if(component=="label")
-        label[name]=vishsprite;
-}
-
-void createCircle (string name, COLOR color, float x,float y,float z, float r, int NoOfParts, string component, int fill){
-    int parts = NoOfParts;
-    float radius = r;
-    GLfloat vertex_buffer_data[parts*9];
-    GLfloat color_buffer_data[parts*9];
+
+    /* component names a display (its segments are "seg1".."seg7") or is "label" */
+    static const char *displays[HUD_DIGITS] = { "point1", "point2", "point3", "sec1", "sec2", "min1", "min2" };
+    int digit = -1;
+    for(int d=0;d<HUD_DIGITS;d++)
+        if(component==displays[d])
+            digit = d;
+    hud.pos.push_back(glm::vec3(x,y,0));
+    hud.mesh.push_back(rectangle);
+    hud.digit.push_back(digit);
+    hud.segment.push_back(digit>=0 ? name[3]-'1' : 0);
+}
+
+/* A disc of 'parts' triangles around the origin, one unit up */
+void circleGeometry(GLfloat *vertex_buffer_data, GLfloat *color_buffer_data, COLOR color, float radius, int parts){
     int i,j;
     float angle=(2*M_PI/parts);
     float current_angle = 0;
@@ -729,536 +1140,2847 @@ void createCircle (string name, COLOR color, float x,float y,float z, float r, i
         vertex_buffer_data[i*9+8]=radius*sin(current_angle+angle);
         current_angle+=angle;
     }
+}
+
+void addSwitchMesh(int lvl, glm::vec3 at, VAO *mesh){
+    switches[lvl].pos.push_back(at);
+    switches[lvl].mesh.push_back(mesh);
+}
+
+void createCircle (COLOR color, float x,float y,float z, float r, int NoOfParts, int lvl, int fill){
+    int parts = NoOfParts;
+    size_t mark = frameArena.used;
+    GLfloat *vertex_buffer_data = (GLfloat*) arenaAlloc(frameArena, parts*9*sizeof(GLfloat));
+    GLfloat *color_buffer_data = (GLfloat*) arenaAlloc(frameArena, parts*9*sizeof(GLfloat));
+    circleGeometry(vertex_buffer_data, color_buffer_data, color, r, parts);
     VAO* circle;
     if(fill==1)
         circle = create3DObject(GL_TRIANGLES, (parts*9)/3, vertex_buffer_data, color_buffer_data, GL_FILL);
     else
         circle = create3DObject(GL_TRIANGLES, (parts*9)/3, vertex_buffer_data, color_buffer_data, GL_LINE);
-    Sprite vishsprite = {};
-    vishsprite.color = color;
-    vishsprite.name = name;
-    vishsprite.object = circle;
-    vishsprite.x=x;
-    vishsprite.y=y;
-    vishsprite.z=z;
-    vishsprite.height=2*r; //Height of the sprite is 2*r
-    vishsprite.width=2*r; //Width of the sprite is 2*r
-    vishsprite.status=1;
-    vishsprite.radius=r;
-    vishsprite.fixed=0;
-
-    if(component=="switch")
-        switches[name]=vishsprite;
+    frameArena.used = mark;
+    addSwitchMesh(lvl, glm::vec3(x,y,z), circle);
 }
 
+/**************************
+ * Level grid and moves   *
+ **************************/
 
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-
-double mouse_pos_x, mouse_pos_y;
-double new_mouse_pos_x, new_mouse_pos_y;
-float angle=0;
-float xpos;
-float ypos = 2720;
-int num = 1;
-int flag =0;
-int gir1 =0;
-int gir2 =0;
-int score =0;
-int gameover=0;
-int count=0;
-float downfall =.1;
-float downtile = 0;
-int tileflag =0;
-float tileX;
-float tileZ;
-int switch1 =0;
-int switch2 =0;
-int sig=0;
+#define TILE_SIZE 60.0f
+#define GRID_BORDER 2   // empty cells around the level so every roll stays inside the grid
 
+/* What a grid cell holds */
+enum { CELL_EMPTY=0, CELL_NORMAL, CELL_FRAGILE, CELL_SWITCH_HEAVY, CELL_SWITCH_SOFT, CELL_BRIDGE, CELL_GOAL,
+       CELL_TELEPORT, CELL_CRUMBLING, CELL_TYPES };
 
-void draw (GLFWwindow* window, int width, int height)
-{
+/* When the block holds a cell up: always, or only while the cell's gate bit is set
+   (bridge) or still clear (crumbling) */
+enum { HOLD_NEVER=0, HOLD_ALWAYS, HOLD_GATE_SET, HOLD_GATE_CLEAR };
 
-    if(gameover ==1)
-        return;
+/* What it takes to press a switch cell */
+enum { PRESS_NONE=0, PRESS_STANDING, PRESS_ANY };
 
-    if(key_pressed_T == 1){
-        eye_x = block["block"].x_change;
-        eye_y = 1300;
-        eye_z = block["block"].z_change;
-        target_x = block["block"].x_change;
-        target_y = 0;
-        target_z = block["block"].z_change - 10;
-    }
-    else if(key_pressed_F ==1){
-        eye_x = block["block"].x_change ;
-        eye_y = block["block"].y_change +300;
-        eye_z = block["block"].z_change +300;
-        target_x = block["block"].x_change;
-        target_y = block["block"].y_change;
-        target_z = block["block"].z_change;
-    }
-    else if(key_pressed_B ==1){
-        eye_x = block["block"].x_change;
-        eye_y = block["block"].y_change + 300; 
-        eye_z = block["block"].z_change + 50;
-        target_x = block["block"].x_change;
-        target_y = block["block"].y_change;
-        target_z = block["block"].z_change - 200;   
-    }
+struct TileBehavior {
+    char glyph;           // in level files
+    unsigned char hold;   // HOLD_*
+    bool standing;        // carries the block standing; fragile tiles break instead
+    unsigned char press;  // PRESS_*
+    bool teleport;        // standing on it moves the block to the linked cell
+    bool crumbles;        // sets its gate bit once the block rolls off it
+    bool goal;            // standing on it drops the block through
+};
+typedef struct TileBehavior TileBehavior;
+
+/* Everything the move compiler knows about a cell type; a new type is a new row here */
+static constexpr TileBehavior tileBehavior[CELL_TYPES] = {
+    /* EMPTY        */ { '.', HOLD_NEVER,      false, PRESS_NONE,     false, false, false },
+    /* NORMAL       */ { '#', HOLD_ALWAYS,     true,  PRESS_NONE,     false, false, false },
+    /* FRAGILE      */ { 'o', HOLD_ALWAYS,     false, PRESS_NONE,     false, false, false },
+    /* SWITCH_HEAVY */ { '^', HOLD_ALWAYS,     true,  PRESS_STANDING, false, false, false },
+    /* SWITCH_SOFT  */ { '~', HOLD_ALWAYS,     true,  PRESS_ANY,      false, false, false },
+    /* BRIDGE       */ { '=', HOLD_GATE_SET,   true,  PRESS_NONE,     false, false, false },
+    /* GOAL         */ { 'H', HOLD_ALWAYS,     true,  PRESS_NONE,     false, false, true  },
+    /* TELEPORT     */ { 'T', HOLD_ALWAYS,     true,  PRESS_NONE,     true,  false, false },
+    /* CRUMBLING    */ { '%', HOLD_GATE_CLEAR, true,  PRESS_NONE,     false, true,  false },
+};
 
+/* Block orientation, same values as blocks.direction */
+enum { STANDING=0, LYING_X=1, LYING_Z=2 };
 
-    glClearColor(1.0f,1.0f,1.0f,1.0f);//set background color
-    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glUseProgram (programID);
-      
-    int fbwidth=width, fbheight=height; 
-    glm::vec3 eye ( eye_x ,eye_y, eye_z );
-    glm::vec3 target (target_x,target_y, target_z);
-    glm::vec3 up (0, 1, 0);
-    Matrices.view = glm::lookAt(eye, target, up);
+/* The four rolls, in arrow key order */
+enum { MOVE_UP=0, MOVE_DOWN, MOVE_LEFT, MOVE_RIGHT };
 
+/* What happens to the block after a roll */
+enum { STEP_OK=0, STEP_FALL, STEP_BREAK, STEP_GOAL };
 
-    for(map<string,Sprite>::iterator it1=point1.begin();it1!=point1.end();it1++){
-        point1[it1->first].status=0;
-    }
-    for(map<string,Sprite>::iterator it1=point2.begin();it1!=point2.end();it1++){
-        point2[it1->first].status=0;
-    }
-    for(map<string,Sprite>::iterator it1=point3.begin();it1!=point3.end();it1++){
-        point3[it1->first].status=0;
-    }
-    for(map<string,Sprite>::iterator it1=sec1.begin();it1!=sec1.end();it1++){
-        sec1[it1->first].status=0;
-    }
-    for(map<string,Sprite>::iterator it1=sec2.begin();it1!=sec2.end();it1++){
-        sec2[it1->first].status=0;
-    }
-    for(map<string,Sprite>::iterator it1=min1.begin();it1!=min1.end();it1++){
-        min1[it1->first].status=0;
-    }
-    for(map<string,Sprite>::iterator it1=min2.begin();it1!=min2.end();it1++){
-        min2[it1->first].status=0;
-    }
+struct Transition {
+    unsigned int next;      // state after the roll
+    unsigned char outcome;  // STEP_*
+};
+typedef struct Transition Transition;
 
+/* One bit per cell, each row padded to whole 256-bit chunks */
+struct Bitboard {
+    int rows;
+    int words;               // 64-bit words per row, multiple of 4
+    vector<uint64_t> bits;   // rows*words
+};
+typedef struct Bitboard Bitboard;
+
+/* Legal resting places for one gate state; bit i of row r is the block's first cell */
+struct PlacementMasks {
+    int words;
+    vector<uint64_t> open;     // cell can carry the block
+    vector<uint64_t> stand;    // standing is supported (open and not fragile)
+    vector<uint64_t> lyingX;   // cells i and i+1 are open
+    vector<uint64_t> lyingZ;   // cells in rows r and r+1 are open
+};
+typedef struct PlacementMasks PlacementMasks;
 
-    int time = abs(seconds % 60);
+/* What pressing a switch does to one gate */
+enum { ACTION_TOGGLE=0, ACTION_OPEN, ACTION_CLOSE };
 
-    int two;
+#define MAX_GATES 16   // gate bits are part of the state index
+#define MAX_STATES (1u<<22)     // table budget: 16M transitions, 128 MB
+#define MAX_SWITCHES 127        // a cell's switch is a signed char
 
-    two = time%10;
-    if(two == 0 || two == 2 ||two == 3 ||two == 5 ||two == 6 ||two == 7 ||two == 8 ||two == 9){
-    sec1["seg1"].status=1;
-    }
-    if(two == 0 || two == 1 ||two == 2 ||two == 3 ||two == 4 ||two == 7 ||two == 8 ||two == 9){
-    sec1["seg2"].status=1;
-    }
-    if(two == 0 || two == 1 ||two == 3 ||two == 4 ||two == 5  ||two == 6 ||two == 7 ||two == 8 ||two == 9){
-    sec1["seg3"].status=1;
-    }
-    if(two == 0 || two == 2 ||two == 3 ||two == 5 ||two == 6 ||two == 8 ||two == 9){
-    sec1["seg4"].status=1;
-    }
-    if(two == 0 || two == 2 ||two == 6 ||two == 8){
-    sec1["seg5"].status=1;
-    }
-    if(two == 0 || two == 4 ||two == 5 ||two == 6 ||two == 8 ||two == 9){
-    sec1["seg6"].status=1;
-    }
-    if(two == 2 ||two == 3  ||two == 4 ||two == 5 ||two == 6 ||two == 8 ||two == 9){
-    sec1["seg7"].status=1;
-    }
+struct TriggerAction {
+    int op;      // ACTION_*
+    int gate;
+};
+typedef struct TriggerAction TriggerAction;
 
+/* A switch's action list, also folded into three masks so pressing any switch is
+   bits = ((bits | open) & ~close) ^ toggle however long the list is */
+struct Trigger {
+    vector<TriggerAction> actions;
+    unsigned int open, close, toggle;
+};
+typedef struct Trigger Trigger;
+
+/* A state packs (cell, orientation, gate bits) into one index:
+   state = ((cell*3 + orientation) << numGates) | gateBits
+   A bridge cell holds the block while its gate bit is set */
+struct Level {
+    int cols,rows;
+    float x0,z0;                 // world position of cell 0
+    vector<unsigned char> cells; // CELL_* per cell
+    vector<signed char> gate;    // gate of a bridge or crumbling cell, -1 otherwise
+    vector<signed char> trigger; // switch of a switch cell, -1 otherwise
+    vector<int> link;            // where a teleport cell sends the block, -1 otherwise
+    vector<Trigger> triggers;    // per switch
+    int numSwitches;
+    int numGates;
+    int start;                   // start cell, block standing
+    int goal;                    // hole cell
+    vector<Transition> table;    // numStates()*4 entries, indexed state*4 + move
+
+    Bitboard solid;              // normal, fragile and goal cells
+    Bitboard solidNext;          // solid shifted by one cell, bit i = cell i+1
+    Bitboard fragile;
+    vector<Bitboard> bridges;    // per gate: its bridge cells
+    vector<Bitboard> bridgesNext;
+    vector<Bitboard> crumbles;   // per gate: its crumbling cell
+    vector<Bitboard> crumblesNext;
+};
+typedef struct Level Level;
+
+int cellAt(const Level &lv, float x, float z){
+    int c = (int)floor((x - lv.x0)/TILE_SIZE + 0.5f);
+    int r = (int)floor((z - lv.z0)/TILE_SIZE + 0.5f);
+    if(c<0 || r<0 || c>=lv.cols || r>=lv.rows)
+        return -1;
+    return r*lv.cols + c;
+}
 
-    time = time/10;
-    two = time%10;
+/* True when a cols x rows grid with numGates gates has at most MAX_STATES states, so its
+   table fits the budget and every state*4 + move an unsigned int */
+bool levelFits(int cols, int rows, int numGates){
+    return cols>0 && rows>0 && numGates>=0 && numGates<=MAX_GATES &&
+           (uint64_t)cols*rows*3 <= (MAX_STATES >> numGates);
+}
 
-    if(two == 0 || two == 2 ||two == 3 ||two == 5 ||two == 6 ||two == 7 ||two == 8 ||two == 9){
-    sec2["seg1"].status=1;
-    }
-    if(two == 0 || two == 1 ||two == 2 ||two == 3 ||two == 4 ||two == 7 ||two == 8 ||two == 9){
-    sec2["seg2"].status=1;
-    }
-    if(two == 0 || two == 1 ||two == 3 ||two == 4 ||two == 5  ||two == 6 ||two == 7 ||two == 8 ||two == 9){
-    sec2["seg3"].status=1;
-    }
-    if(two == 0 || two == 2 ||two == 3 ||two == 5 ||two == 6 ||two == 8 ||two == 9){
-    sec2["seg4"].status=1;
-    }
-    if(two == 0 || two == 2 ||two == 6 ||two == 8){
-    sec2["seg5"].status=1;
-    }
-    if(two == 0 || two == 4 ||two == 5 ||two == 6 ||two == 8 ||two == 9){
-    sec2["seg6"].status=1;
-    }
-    if(two == 2 ||two == 3  ||two == 4 ||two == 5 ||two == 6 ||two == 8 ||two == 9){
-    sec2["seg7"].status=1;
-    }
+unsigned int numStates(const Level &lv){
+    return (unsigned int)((uint64_t)lv.cols*lv.rows*3 << lv.numGates);
+}
 
+unsigned int makeState(const Level &lv, int cell, int orientation, unsigned int gateBits){
+    return ((unsigned int)(cell*3 + orientation) << lv.numGates) | gateBits;
+}
 
-    for(map<string,Sprite>::iterator it1=sec1.begin();it1!=sec1.end();it1++){
-        string current = it1->first; 
+int stateCell(const Level &lv, unsigned int state){
+    return (state >> lv.numGates) / 3;
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+int stateOrientation(const Level &lv, unsigned int state){
+    return (state >> lv.numGates) % 3;
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+unsigned int stateGates(const Level &lv, unsigned int state){
+    return state & ((1u << lv.numGates) - 1);
+}
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
+/* Empty grid for a cols x rows level whose first tile sits at (x,z); adds the border */
+void allocLevelGrid(Level &lv, int cols, int rows, float x, float z){
+    lv.x0 = x - GRID_BORDER*TILE_SIZE;
+    lv.z0 = z - GRID_BORDER*TILE_SIZE;
+    lv.cols = cols + 2*GRID_BORDER;
+    lv.rows = rows + 2*GRID_BORDER;
+    lv.cells.assign(lv.cols*lv.rows, CELL_EMPTY);
+    lv.gate.assign(lv.cols*lv.rows, -1);
+    lv.trigger.assign(lv.cols*lv.rows, -1);
+    lv.link.assign(lv.cols*lv.rows, -1);
+    lv.triggers.clear();
+    lv.numSwitches = 0;
+    lv.numGates = 0;
+    lv.start = lv.goal = 0;
+    lv.table.clear();
+}
 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+/* Make a cell a switch with no actions yet, heavy unless it already is a soft one; returns its index */
+int addSwitchCell(Level &lv, int cell){
+    if(lv.cells[cell]!=CELL_SWITCH_SOFT)
+        lv.cells[cell] = CELL_SWITCH_HEAVY;
+    lv.trigger[cell] = lv.numSwitches;
+    lv.triggers.push_back(Trigger());
+    return lv.numSwitches++;
+}
 
-        if(sec1[current].status==0)
-        continue;
+int addSwitch(Level &lv, float x, float z){
+    return addSwitchCell(lv, cellAt(lv,x,z));
+}
 
-        Matrices.model = glm::mat4(1.0f);
+/* Append one edge of the trigger graph: pressing 'sw' does 'op' to 'gate' */
+void addAction(Level &lv, int sw, int op, int gate){
+    TriggerAction a = { op, gate };
+    lv.triggers[sw].actions.push_back(a);
+    lv.numGates = max(lv.numGates, gate+1);
+}
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(sec1[current].x,sec1[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(sec1[current].object);
-    }
+/* The tile at (x,z) only exists while 'gate' is open */
+void addBridge(Level &lv, float x, float z, int gate){
+    int cell = cellAt(lv,x,z);
+    lv.cells[cell] = CELL_BRIDGE;
+    lv.gate[cell] = gate;
+    lv.numGates = max(lv.numGates, gate+1);
+}
 
+/* Standing on the teleport cell 'from' moves the block, still standing, to 'to' */
+void addTeleport(Level &lv, int from, int to){
+    lv.cells[from] = CELL_TELEPORT;
+    lv.link[from] = to;
+}
 
-    for(map<string,Sprite>::iterator it1=sec2.begin();it1!=sec2.end();it1++){
-        string current = it1->first; 
+/* Give every crumbling cell without one its own gate; false when the gates run out */
+bool assignCrumbleGates(Level &lv){
+    for(int cell=0;cell<lv.cols*lv.rows;cell++){
+        if(lv.cells[cell]!=CELL_CRUMBLING || lv.gate[cell]>=0)
+            continue;
+        if(lv.numGates==MAX_GATES)
+            return false;
+        lv.gate[cell] = lv.numGates++;
+    }
+    return true;
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+/* Fold each action list into its masks, in list order: a toggle after an open closes */
+void compileTriggers(Level &lv){
+    for(int sw=0;sw<lv.numSwitches;sw++){
+        Trigger &tr = lv.triggers[sw];
+        tr.open = tr.close = tr.toggle = 0;
+        for(size_t i=0;i<tr.actions.size();i++){
+            unsigned int bit = 1u << tr.actions[i].gate;
+            switch(tr.actions[i].op){
+                case ACTION_OPEN:
+                    tr.open |= bit; tr.close &= ~bit; tr.toggle &= ~bit;
+                    break;
+                case ACTION_CLOSE:
+                    tr.close |= bit; tr.open &= ~bit; tr.toggle &= ~bit;
+                    break;
+                default:
+                    if(tr.open & bit)       { tr.open &= ~bit; tr.close |= bit; }
+                    else if(tr.close & bit) { tr.close &= ~bit; tr.open |= bit; }
+                    else                    tr.toggle ^= bit;
+                    break;
+            }
+        }
+    }
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+unsigned int pressSwitch(const Trigger &tr, unsigned int bits){
+    return ((bits | tr.open) & ~tr.close) ^ tr.toggle;
+}
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
+/**************************
+ * Bitboards              *
+ **************************/
 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+void initBitboard(Bitboard &bb, const Level &lv){
+    bb.rows = lv.rows;
+    bb.words = ((lv.cols + 255)/256)*4;
+    bb.bits.assign(bb.rows*bb.words, 0);
+}
 
-        if(sec2[current].status==0)
-        continue;
+void setCellBit(Bitboard &bb, int row, int col){
+    bb.bits[row*bb.words + col/64] |= (uint64_t)1 << (col%64);
+}
 
-        Matrices.model = glm::mat4(1.0f);
+inline int maskBit(const vector<uint64_t> &mask, int words, int row, int col){
+    return (mask[row*words + col/64] >> (col%64)) & 1;
+}
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(sec2[current].x,sec2[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(sec2[current].object);
+/* Solid, fragile and per-gate bridge and crumbling boards of a level, plus copies shifted
+   by one column */
+void buildBitboards(Level &lv){
+    initBitboard(lv.solid,lv);
+    initBitboard(lv.solidNext,lv);
+    initBitboard(lv.fragile,lv);
+    lv.bridges.resize(lv.numGates);
+    lv.bridgesNext.resize(lv.numGates);
+    lv.crumbles.resize(lv.numGates);
+    lv.crumblesNext.resize(lv.numGates);
+    for(int i=0;i<lv.numGates;i++){
+        initBitboard(lv.bridges[i],lv);
+        initBitboard(lv.bridgesNext[i],lv);
+        initBitboard(lv.crumbles[i],lv);
+        initBitboard(lv.crumblesNext[i],lv);
     }
 
+    for(int cell=0;cell<lv.cols*lv.rows;cell++){
+        int col = cell % lv.cols, row = cell / lv.cols;
+        const TileBehavior &b = tileBehavior[lv.cells[cell]];
+        Bitboard *board = NULL, *next = NULL;
+        if(b.hold==HOLD_ALWAYS){
+            board = &lv.solid;
+            next = &lv.solidNext;
+        }
+        else if(b.hold==HOLD_GATE_SET){
+            board = &lv.bridges[lv.gate[cell]];
+            next = &lv.bridgesNext[lv.gate[cell]];
+        }
+        else if(b.hold==HOLD_GATE_CLEAR){
+            board = &lv.crumbles[lv.gate[cell]];
+            next = &lv.crumblesNext[lv.gate[cell]];
+        }
+        if(!board)
+            continue;
+        setCellBit(*board,row,col);
+        if(col>0)
+            setCellBit(*next,row,col-1);
+        if(!b.standing)
+            setCellBit(lv.fragile,row,col);
+    }
+}
 
-    int time1 = abs(seconds/60);
-
-    int the = time1%10;
+/* stand = open & ~fragile, lyingX = open & openNext, lyingZ = open & (open one row down).
+   n is a multiple of 4 words; open has one extra all-zero row at the end. */
+typedef void (*PlacementKernel)(const uint64_t*, const uint64_t*, const uint64_t*, uint64_t*, uint64_t*, uint64_t*, int, int);
 
-    if(the == 0 || the == 2 ||the == 3 ||the == 5 ||the == 6 ||the == 7 ||the == 8 ||the == 9){
-    
-    min1["seg1"].status=1;
+static void placementKernelScalar(const uint64_t *open, const uint64_t *openNext, const uint64_t *fragile,
+                                  uint64_t *stand, uint64_t *lyingX, uint64_t *lyingZ, int n, int words){
+    for(int i=0;i<n;i++){
+        stand[i] = open[i] & ~fragile[i];
+        lyingX[i] = open[i] & openNext[i];
+        lyingZ[i] = open[i] & open[i+words];
     }
-    if(the == 0 || the == 1 ||the == 2 ||the == 3 ||the == 4 ||the == 7 ||the == 8 ||the == 9){
-    
-    min1["seg2"].status=1;
-    }
-    if(the == 0 || the == 1 ||the == 3 ||the == 4 ||the == 5  ||the == 6 ||the == 7 ||the == 8 ||the == 9){
-    
-    min1["seg3"].status=1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void placementKernelSSE2(const uint64_t *open, const uint64_t *openNext, const uint64_t *fragile,
+                                uint64_t *stand, uint64_t *lyingX, uint64_t *lyingZ, int n, int words){
+    for(int i=0;i<n;i+=2){
+        __m128i o = _mm_loadu_si128((const __m128i*)(open+i));
+        __m128i on = _mm_loadu_si128((const __m128i*)(openNext+i));
+        __m128i od = _mm_loadu_si128((const __m128i*)(open+i+words));
+        __m128i f = _mm_loadu_si128((const __m128i*)(fragile+i));
+        _mm_storeu_si128((__m128i*)(stand+i), _mm_andnot_si128(f,o));
+        _mm_storeu_si128((__m128i*)(lyingX+i), _mm_and_si128(o,on));
+        _mm_storeu_si128((__m128i*)(lyingZ+i), _mm_and_si128(o,od));
     }
-    if(the == 0 || the == 2 ||the == 3 ||the == 5 ||the == 6 ||the == 8 ||the == 9){
-    
-    min1["seg4"].status=1;
+}
+
+__attribute__((target("avx2")))
+static void placementKernelAVX2(const uint64_t *open, const uint64_t *openNext, const uint64_t *fragile,
+                                uint64_t *stand, uint64_t *lyingX, uint64_t *lyingZ, int n, int words){
+    for(int i=0;i<n;i+=4){
+        __m256i o = _mm256_loadu_si256((const __m256i*)(open+i));
+        __m256i on = _mm256_loadu_si256((const __m256i*)(openNext+i));
+        __m256i od = _mm256_loadu_si256((const __m256i*)(open+i+words));
+        __m256i f = _mm256_loadu_si256((const __m256i*)(fragile+i));
+        _mm256_storeu_si256((__m256i*)(stand+i), _mm256_andnot_si256(f,o));
+        _mm256_storeu_si256((__m256i*)(lyingX+i), _mm256_and_si256(o,on));
+        _mm256_storeu_si256((__m256i*)(lyingZ+i), _mm256_and_si256(o,od));
     }
-    if(the == 0 || the == 2 ||the == 6 ||the == 8){
-    
-    min1["seg5"].status=1;
+}
+#endif
+
+const char *placementKernelName = "scalar";
+
+/* Pick the widest kernel the CPU supports, once */
+PlacementKernel placementKernel(){
+    static PlacementKernel kernel = NULL;
+    if(kernel)
+        return kernel;
+    kernel = placementKernelScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        kernel = placementKernelAVX2;
+        placementKernelName = "avx2";
     }
-    if(the == 0 || the == 4 ||the == 5 ||the == 6 ||the == 8 ||the == 9){
-    
-    min1["seg6"].status=1;
+    else if(__builtin_cpu_supports("sse2")){
+        kernel = placementKernelSSE2;
+        placementKernelName = "sse2";
     }
-    if(the == 2 ||the == 3  ||the == 4 ||the == 5 ||the == 6 ||the == 8 ||the == 9){
-    
-    min1["seg7"].status=1;
+#endif
+    return kernel;
+}
+
+/* Masks of every legal resting place on the whole board for one gate state */
+void computePlacementMasks(const Level &lv, unsigned int gateBits, PlacementMasks &pm){
+    int words = lv.solid.words;
+    int n = lv.rows*words;
+    vector<uint64_t> openNext(lv.solidNext.bits);
+
+    pm.words = words;
+    pm.open.assign(n + words, 0);
+    copy(lv.solid.bits.begin(), lv.solid.bits.end(), pm.open.begin());
+    for(int s=0;s<lv.numGates;s++){
+        const Bitboard &board = (gateBits & (1u << s)) ? lv.bridges[s] : lv.crumbles[s];
+        const Bitboard &next = (gateBits & (1u << s)) ? lv.bridgesNext[s] : lv.crumblesNext[s];
+        for(int i=0;i<n;i++){
+            pm.open[i] |= board.bits[i];
+            openNext[i] |= next.bits[i];
+        }
     }
+    pm.stand.resize(n);
+    pm.lyingX.resize(n);
+    pm.lyingZ.resize(n);
+    placementKernel()(&pm.open[0], &openNext[0], &lv.fragile.bits[0], &pm.stand[0], &pm.lyingX[0], &pm.lyingZ[0], n, words);
+}
 
-    time1 = time1/10;
-    the=time1%10;
+/* Outcome of the block resting at (cell, orientation), read from the placement masks */
+int placementOutcome(const Level &lv, const PlacementMasks &pm, int cell, int orientation){
+    int col = cell % lv.cols, row = cell / lv.cols;
+    if(orientation==LYING_X)
+        return maskBit(pm.lyingX,pm.words,row,col) ? STEP_OK : STEP_FALL;
+    if(orientation==LYING_Z)
+        return maskBit(pm.lyingZ,pm.words,row,col) ? STEP_OK : STEP_FALL;
+    if(maskBit(pm.stand,pm.words,row,col))
+        return tileBehavior[lv.cells[cell]].goal ? STEP_GOAL : STEP_OK;
+    return maskBit(pm.open,pm.words,row,col) ? STEP_BREAK : STEP_FALL;
+}
 
-    if(the == 0 || the == 2 ||the == 3 ||the == 5 ||the == 6 ||the == 7 ||the == 8 ||the == 9){
-    min2["seg1"].status=1;
-    }
-    if(the == 0 || the == 1 ||the == 2 ||the == 3 ||the == 4 ||the == 7 ||the == 8 ||the == 9){
-    min2["seg2"].status=1;
-    }
-    if(the == 0 || the == 1 ||the == 3 ||the == 4 ||the == 5  ||the == 6 ||the == 7 ||the == 8 ||the == 9){
-    min2["seg3"].status=1;
+/* Build the dense (state, move) -> (state, outcome) table of a level; false, with no table,
+   when the level has more than MAX_STATES states */
+bool compileTransitions(Level &lv){
+    /* cell offset in columns/rows and new orientation, per orientation and move */
+    static const int roll[3][4][3] = {
+        /* STANDING */ { {0,-2,LYING_Z}, {0,1,LYING_Z}, {-2,0,LYING_X}, {1,0,LYING_X} },
+        /* LYING_X  */ { {0,-1,LYING_X}, {0,1,LYING_X}, {-1,0,STANDING}, {2,0,STANDING} },
+        /* LYING_Z  */ { {0,-1,STANDING}, {0,2,STANDING}, {-1,0,LYING_Z}, {1,0,LYING_Z} }
+    };
+    assignCrumbleGates(lv);     // may add gates, so before the table is sized
+    if(!levelFits(lv.cols, lv.rows, lv.numGates)){
+        lv.table.clear();
+        return false;
     }
-    if(the == 0 || the == 2 ||the == 3 ||the == 5 ||the == 6 ||the == 8 ||the == 9){
-    min2["seg4"].status=1;
+    unsigned int total = numStates(lv);
+    lv.table.resize((size_t)total*4);
+
+    compileTriggers(lv);
+    buildBitboards(lv);
+    vector<PlacementMasks> masks(1u << lv.numGates);
+    for(unsigned int bits=0;bits<masks.size();bits++)
+        computePlacementMasks(lv,bits,masks[bits]);
+
+    for(unsigned int s=0;s<total;s++){
+        int cell = stateCell(lv,s);
+        int orientation = stateOrientation(lv,s);
+        unsigned int bits = stateGates(lv,s);
+        int col = cell % lv.cols, row = cell / lv.cols;
+
+        for(int m=0;m<4;m++){
+            Transition &t = lv.table[(size_t)s*4+m];
+            int c = col + roll[orientation][m][0];
+            int r = row + roll[orientation][m][1];
+            int o = roll[orientation][m][2];
+            int lastC = c + (o==LYING_X), lastR = r + (o==LYING_Z);
+            if(c<0 || r<0 || lastC>=lv.cols || lastR>=lv.rows){
+                // only reachable from cells inside the border, which are never supported
+                t.next = s;
+                t.outcome = STEP_FALL;
+                continue;
+            }
+            int target = r*lv.cols + c;
+            int covered[2] = { target, lastR*lv.cols + lastC };
+            int other = orientation==LYING_X ? cell+1 : (orientation==LYING_Z ? cell+lv.cols : cell);
+            int left[2] = { cell, other<lv.cols*lv.rows ? other : cell };
+            unsigned int nbits = bits;
+            for(int i=0;i<2;i++){
+                int from = left[i];
+                if(tileBehavior[lv.cells[from]].crumbles && from!=covered[0] && from!=covered[1])
+                    nbits |= 1u << lv.gate[from];
+            }
+            for(int i=0;i<(o==STANDING ? 1 : 2);i++){
+                int press = tileBehavior[lv.cells[covered[i]]].press;
+                if(press==PRESS_ANY || (press==PRESS_STANDING && o==STANDING))
+                    nbits = pressSwitch(lv.triggers[lv.trigger[covered[i]]], nbits);
+            }
+            if(o==STANDING && tileBehavior[lv.cells[target]].teleport
+               && placementOutcome(lv,masks[nbits],target,o)==STEP_OK)
+                target = lv.link[target];
+            t.next = makeState(lv,target,o,nbits);
+            t.outcome = placementOutcome(lv,masks[nbits],target,o);
+        }
     }
-    if(the == 0 || the == 2 ||the == 6 ||the == 8){
-    min2["seg5"].status=1;
+    return true;
+}
+
+
+/**************************
+ * Solver                 *
+ **************************/
+
+enum { SOLVE_BFS=0, SOLVE_ASTAR, SOLVE_IDA };
+
+/* Seconds on a monotonic clock; glfwGetTime needs glfwInit, which the headless tools skip */
+double wallClock(){
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct SolveResult {
+    int length;                // optimal number of rolls, -1 if unsolvable
+    vector<unsigned char> path;
+    unsigned long expanded;    // states whose moves were generated
+    unsigned long generated;
+    size_t peakBytes;          // open list + closed set + parent links at their largest
+    double ms;
+};
+typedef struct SolveResult SolveResult;
+
+/* Closed set: 4096-state bitset pages, allocated only for parts of the state space the search touches */
+struct StateSet {
+    unordered_map<unsigned int, vector<uint64_t> > pages;
+
+    bool insert(unsigned int s){
+        vector<uint64_t> &page = pages[s >> 12];
+        if(page.empty())
+            page.assign(64, 0);
+        uint64_t bit = (uint64_t)1 << (s & 63);
+        uint64_t &word = page[(s >> 6) & 63];
+        if(word & bit)
+            return false;
+        word |= bit;
+        return true;
     }
-    if(the == 0 || the == 4 ||the == 5 ||the == 6 ||the == 8 ||the == 9){
-    min2["seg6"].status=1;
+    bool contains(unsigned int s) const {
+        unordered_map<unsigned int, vector<uint64_t> >::const_iterator it = pages.find(s >> 12);
+        return it!=pages.end() && ((it->second[(s >> 6) & 63] >> (s & 63)) & 1);
     }
-    if(the == 2 ||the == 3  ||the == 4 ||the == 5 ||the == 6 ||the == 8 ||the == 9){
-    min2["seg7"].status=1;
+    size_t bytes() const {
+        return pages.size()*(64*sizeof(uint64_t) + sizeof(vector<uint64_t>) + 4*sizeof(void*));
     }
+};
 
+/* Relaxed distance: rolls needed if the block could slide cell by cell ignoring orientation
+   and switches, with teleports free. A roll moves the covered cells at most two steps, so
+   ceil(d/2) never overestimates. Teleports are zero-cost edges, hence the 0-1 BFS */
+void relaxedDistances(const Level &lv, vector<int> &dist){
+    int ncells = lv.cols*lv.rows;
+    vector<vector<int> > into(ncells);
+    for(int cell=0;cell<ncells;cell++)
+        if(lv.cells[cell]==CELL_TELEPORT && lv.link[cell]>=0)
+            into[lv.link[cell]].push_back(cell);
+
+    dist.assign(ncells, INT_MAX);
+    deque<int> queue(1, lv.goal);
+    dist[lv.goal] = 0;
+    while(!queue.empty()){
+        int cell = queue.front();
+        queue.pop_front();
+        for(size_t i=0;i<into[cell].size();i++){
+            int n = into[cell][i];
+            if(dist[n] > dist[cell]){
+                dist[n] = dist[cell];
+                queue.push_front(n);
+            }
+        }
+        int col = cell % lv.cols;
+        int next[4] = { cell-lv.cols, cell+lv.cols, col>0 ? cell-1 : -1, col<lv.cols-1 ? cell+1 : -1 };
+        for(int i=0;i<4;i++){
+            int n = next[i];
+            if(n<0 || n>=ncells || lv.cells[n]==CELL_EMPTY || dist[n] <= dist[cell]+1)
+                continue;
+            dist[n] = dist[cell] + 1;
+            queue.push_back(n);
+        }
+    }
+}
 
-    for(map<string,Sprite>::iterator it1=min1.begin();it1!=min1.end();it1++){
-        string current = it1->first; 
+int heuristic(const Level &lv, const vector<int> &dist, unsigned int state){
+    int cell = stateCell(lv,state);
+    int orientation = stateOrientation(lv,state);
+    int d = dist[cell];
+    if(orientation==LYING_X)
+        d = min(d, dist[cell+1]);
+    else if(orientation==LYING_Z)
+        d = min(d, dist[cell+lv.cols]);
+    return (d==INT_MAX) ? INT_MAX : (d+1)/2;
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+static void tracePath(const unordered_map<unsigned int, unsigned int> &parent, unsigned int s, unsigned int start, int lastMove, SolveResult &res){
+    res.path.assign(1, (unsigned char)lastMove);
+    while(s!=start){
+        unsigned int link = parent.find(s)->second;
+        res.path.push_back((unsigned char)(link & 3));
+        s = link >> 2;
+    }
+    reverse(res.path.begin(), res.path.end());
+    res.length = res.path.size();
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+static size_t parentBytes(const unordered_map<unsigned int, unsigned int> &parent){
+    return parent.size()*(sizeof(pair<const unsigned int, unsigned int>) + 2*sizeof(void*)) + parent.bucket_count()*sizeof(void*);
+}
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
+/* Breadth-first search over the transition table; parent links store (state << 2 | move) */
+void solveBFS(const Level &lv, unsigned int start, SolveResult &res){
+    StateSet closed;
+    unordered_map<unsigned int, unsigned int> parent;
+    vector<unsigned int> frontier(1, start), next;
+    closed.insert(start);
+
+    for(int depth=0;!frontier.empty();depth++){
+        next.clear();
+        for(size_t i=0;i<frontier.size();i++){
+            unsigned int s = frontier[i];
+            res.expanded++;
+            for(int m=0;m<4;m++){
+                Transition t = lv.table[(size_t)s*4+m];
+                res.generated++;
+                if(t.outcome==STEP_GOAL){
+                    res.peakBytes = max(res.peakBytes, closed.bytes() + parentBytes(parent) + (frontier.capacity()+next.capacity())*sizeof(unsigned int));
+                    tracePath(parent, s, start, m, res);
+                    return;
+                }
+                if(t.outcome!=STEP_OK || !closed.insert(t.next))
+                    continue;
+                parent[t.next] = (s << 2) | m;
+                next.push_back(t.next);
+            }
+        }
+        res.peakBytes = max(res.peakBytes, closed.bytes() + parentBytes(parent) + (frontier.capacity()+next.capacity())*sizeof(unsigned int));
+        frontier.swap(next);
+    }
+}
 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+struct OpenNode {
+    int f, g;
+    unsigned int state;
+    unsigned int link;   // (parent << 2) | move
+    bool operator<(const OpenNode &o) const { return f!=o.f ? f>o.f : g<o.g; } // min-f heap, deeper first on ties
+};
 
-        if(min1[current].status==0)
-        continue;
+/* A* with the relaxed distance. It is consistent, so the first time a state is
+   popped its g and parent link are optimal and the state goes straight to the closed set. */
+void solveAStar(const Level &lv, unsigned int start, SolveResult &res){
+    vector<int> dist;
+    relaxedDistances(lv, dist);
+    int h0 = heuristic(lv, dist, start);
+    if(h0==INT_MAX)
+        return;
 
-        Matrices.model = glm::mat4(1.0f);
+    StateSet closed;
+    unordered_map<unsigned int, unsigned int> parent;
+    vector<OpenNode> open;
+    OpenNode root = { h0, 0, start, 0 };
+    open.push_back(root);
+
+    while(!open.empty()){
+        pop_heap(open.begin(), open.end());
+        OpenNode node = open.back();
+        open.pop_back();
+        if(!closed.insert(node.state))
+            continue;
+        if(node.state!=start)
+            parent[node.state] = node.link;
+        res.expanded++;
+        if((res.expanded & 1023)==0)
+            res.peakBytes = max(res.peakBytes, closed.bytes() + parentBytes(parent) + open.capacity()*sizeof(OpenNode));
+
+        for(int m=0;m<4;m++){
+            Transition t = lv.table[(size_t)node.state*4+m];
+            res.generated++;
+            if(t.outcome==STEP_GOAL){
+                res.peakBytes = max(res.peakBytes, closed.bytes() + parentBytes(parent) + open.capacity()*sizeof(OpenNode));
+                tracePath(parent, node.state, start, m, res);
+                return;
+            }
+            if(t.outcome!=STEP_OK || closed.contains(t.next))
+                continue;
+            int h = heuristic(lv, dist, t.next);
+            if(h==INT_MAX)
+                continue;
+            OpenNode child = { node.g + 1 + h, node.g + 1, t.next, (node.state << 2) | m };
+            open.push_back(child);
+            push_heap(open.begin(), open.end());
+        }
+    }
+    res.peakBytes = max(res.peakBytes, closed.bytes() + parentBytes(parent) + open.capacity()*sizeof(OpenNode));
+}
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(min1[current].x,min1[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(min1[current].object);
+/* IDA* keeps a fixed-size, direct-mapped table of (state, depth) seen in the current
+   iteration, so transpositions reached again at the same or a greater depth are cut */
+#define IDA_TABLE_BITS 16
+
+struct IdaEntry {
+    unsigned int state;
+    unsigned short g;
+    unsigned short iteration;
+};
+
+struct IdaSearch {
+    const Level *lv;
+    const vector<int> *dist;
+    vector<IdaEntry> seen;
+    unsigned short iteration;
+    int bound;
+    vector<unsigned char> path;
+    SolveResult *res;
+};
+
+/* Depth-first probe of IDA*; returns -1 when the goal is found, else the smallest f over the bound */
+static int idaProbe(IdaSearch &ida, unsigned int s, int g){
+    const Level &lv = *ida.lv;
+    int h = heuristic(lv, *ida.dist, s);
+    if(h==INT_MAX)          // the hole can't be reached from this cell
+        return INT_MAX;
+    int f = g + h;
+    if(f>ida.bound)
+        return f;
+
+    IdaEntry &e = ida.seen[(s * 2654435761u) >> (32 - IDA_TABLE_BITS)];
+    if(e.state==s && e.iteration==ida.iteration && e.g<=g)
+        return INT_MAX;
+    e.state = s;
+    e.g = g;
+    e.iteration = ida.iteration;
+
+    ida.res->expanded++;
+    int smallest = INT_MAX;
+    for(int m=0;m<4;m++){
+        Transition t = lv.table[(size_t)s*4+m];
+        ida.res->generated++;
+        if(t.outcome==STEP_GOAL){
+            ida.path.push_back((unsigned char)m);
+            return -1;
+        }
+        if(t.outcome!=STEP_OK)
+            continue;
+        ida.path.push_back((unsigned char)m);
+        int r = idaProbe(ida, t.next, g+1);
+        if(r<0)
+            return -1;
+        ida.path.pop_back();
+        smallest = min(smallest, r);
     }
+    return smallest;
+}
 
-    for(map<string,Sprite>::iterator it1=min2.begin();it1!=min2.end();it1++){
-        string current = it1->first; 
+/* IDA*: same heuristic, memory bounded by the table and the solution depth */
+void solveIDA(const Level &lv, unsigned int start, SolveResult &res){
+    vector<int> dist;
+    relaxedDistances(lv, dist);
+
+    IdaSearch ida;
+    IdaEntry empty = { 0, 0, 0 };
+    ida.lv = &lv;
+    ida.dist = &dist;
+    ida.seen.assign(1 << IDA_TABLE_BITS, empty);
+    ida.iteration = 0;
+    ida.bound = heuristic(lv, dist, start);
+    ida.res = &res;
+
+    while(ida.bound!=INT_MAX){
+        ida.iteration++;
+        ida.path.clear();
+        int r = idaProbe(ida, start, 0);
+        // the path doubles as the recursion depth; count a stack frame per step
+        res.peakBytes = max(res.peakBytes, dist.capacity()*sizeof(int) + ida.seen.size()*sizeof(IdaEntry) + ida.path.capacity()*(1 + 64));
+        if(r<0){
+            res.path = ida.path;
+            res.length = ida.path.size();
+            return;
+        }
+        ida.bound = r;
+    }
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+void solveLevel(const Level &lv, unsigned int start, int method, SolveResult &res){
+    res.length = -1;
+    res.path.clear();
+    res.expanded = res.generated = 0;
+    res.peakBytes = 0;
+    double t0 = wallClock();
+    if(method==SOLVE_BFS)
+        solveBFS(lv, start, res);
+    else if(method==SOLVE_ASTAR)
+        solveAStar(lv, start, res);
+    else
+        solveIDA(lv, start, res);
+    res.ms = (wallClock() - t0)*1000.0;
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+/* True when the level can't be solved with the bridges switch 'sw' drives deleted, so every
+   solution needs them */
+bool bridgesNeeded(const Level &lv, int sw){
+    const Trigger &tr = lv.triggers[sw];
+    unsigned int touched = tr.open | tr.close | tr.toggle;
+    Level without = lv;
+    for(int cell=0;cell<lv.cols*lv.rows;cell++)
+        if(without.cells[cell]==CELL_BRIDGE && ((touched >> without.gate[cell]) & 1))
+            without.cells[cell] = CELL_EMPTY;
+    compileTransitions(without);
+    SolveResult res;
+    solveLevel(without, makeState(without, without.start, STANDING, 0), SOLVE_ASTAR, res);
+    return res.length<0;
+}
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+/**************************
+ * Level text files       *
+ **************************/
 
-        if(min2[current].status==0)
-        continue;
+/* A level file is a glyph grid followed by the cells that need more than a glyph:
+
+       grid 6 3
+       ##^...
+       #o#==H
+       ###...
+       start 0 0
+       hole 5 1
+       switch 2 0
+       action 0 toggle 0
+       bridge 3 1 0
+       bridge 4 1 0
+
+   '.' empty, '#' tile, 'o' fragile tile, '^' heavy switch (pressed standing), '~' soft switch
+   (pressed by any part of the block), '=' bridge, 'H' hole, 'T' teleport, '%' crumbling tile
+   (gone once the block rolls off it). The glyphs come from tileBehavior.
+   Coordinates are column and row in the grid; 'teleport c r tc tr' links a teleport to the
+   cell it sends the block to. A bridge names the gate that raises it and
+   'action <switch> toggle|open|close <gate>' lines, switches numbered in file order, make
+   up the trigger graph; with no action lines switch k toggles gate k. 'origin x z' puts
+   cell 0 0 at that world position, 0 0 when missing. Lines starting with '#' before the
+   grid are comments. */
+
+static const char *actionNames[] = { "toggle", "open", "close" };
+
+void writeLevelText(const Level &lv, FILE *out, const string &comment){
+    int minC=lv.cols, maxC=-1, minR=lv.rows, maxR=-1;
+    for(int cell=0;cell<lv.cols*lv.rows;cell++){
+        if(lv.cells[cell]==CELL_EMPTY)
+            continue;
+        minC = min(minC, cell % lv.cols); maxC = max(maxC, cell % lv.cols);
+        minR = min(minR, cell / lv.cols); maxR = max(maxR, cell / lv.cols);
+    }
+    if(!comment.empty())
+        fprintf(out, "# %s\n", comment.c_str());
+    fprintf(out, "grid %d %d\n", maxC-minC+1, maxR-minR+1);
+    for(int r=minR;r<=maxR;r++){
+        for(int c=minC;c<=maxC;c++){
+            fputc(tileBehavior[lv.cells[r*lv.cols + c]].glyph, out);
+        }
+        fputc('\n', out);
+    }
+    /* only levels placed somewhere in the world have an origin; generated ones start at 0 0 */
+    if(lv.x0!=-GRID_BORDER*TILE_SIZE || lv.z0!=-GRID_BORDER*TILE_SIZE)
+        fprintf(out, "origin %g %g\n", lv.x0 + minC*TILE_SIZE, lv.z0 + minR*TILE_SIZE);
+    fprintf(out, "start %d %d\n", lv.start % lv.cols - minC, lv.start / lv.cols - minR);
+    fprintf(out, "hole %d %d\n", lv.goal % lv.cols - minC, lv.goal / lv.cols - minR);
+    vector<int> switchCell(lv.numSwitches, 0);
+    for(int cell=0;cell<lv.cols*lv.rows;cell++)
+        if(lv.trigger[cell]>=0)
+            switchCell[lv.trigger[cell]] = cell;
+    for(int s=0;s<lv.numSwitches;s++)
+        fprintf(out, "switch %d %d\n", switchCell[s] % lv.cols - minC, switchCell[s] / lv.cols - minR);
+    for(int s=0;s<lv.numSwitches;s++)
+        for(size_t i=0;i<lv.triggers[s].actions.size();i++)
+            fprintf(out, "action %d %s %d\n", s, actionNames[lv.triggers[s].actions[i].op], lv.triggers[s].actions[i].gate);
+    for(int cell=0;cell<lv.cols*lv.rows;cell++){
+        if(lv.cells[cell]==CELL_BRIDGE)
+            fprintf(out, "bridge %d %d %d\n", cell % lv.cols - minC, cell / lv.cols - minR, lv.gate[cell]);
+        else if(lv.cells[cell]==CELL_TELEPORT)
+            fprintf(out, "teleport %d %d %d %d\n", cell % lv.cols - minC, cell / lv.cols - minR, lv.link[cell] % lv.cols - minC, lv.link[cell] / lv.cols - minR);
+    }
+}
 
-        Matrices.model = glm::mat4(1.0f);
+/* Cuts the next line out of the text in place; NULL at the end */
+static char* nextLine(char *&p, char *end, int &lineNo){
+    if(p>=end)
+        return NULL;
+    char *line = p;
+    char *nl = (char*)memchr(p, '\n', end-p);
+    p = nl ? nl+1 : end;
+    if(!nl)
+        nl = end;
+    if(nl>line && nl[-1]=='\r')
+        nl--;
+    *nl = 0;
+    lineNo++;
+    return line;
+}
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(min2[current].x,min2[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(min2[current].object);
+/* Parse level text into lv (without compiling its table), in one pass over a buffer it may
+   write to; reports the first error on stderr. 'path' only names the source in messages */
+bool parseLevelText(Level &lv, char *text, size_t size, const char *path){
+    char *p = text, *end = text+size, *line;
+    int lineNo = 0, cols = 0, rows = 0;
+    while((line = nextLine(p, end, lineNo))){
+        if(line[0]==0 || line[0]=='#')
+            continue;
+        if(sscanf(line, "grid %d %d", &cols, &rows)==2)
+            break;
+        fprintf(stderr, "%s:%d: expected 'grid <cols> <rows>'\n", path, lineNo);
+        return false;
+    }
+    if(cols<=0 || rows<=0){
+        fprintf(stderr, "%s: no grid\n", path);
+        return false;
+    }
+    if(cols>(int)MAX_STATES || rows>(int)MAX_STATES || !levelFits(cols + 2*GRID_BORDER, rows + 2*GRID_BORDER, 0)){
+        fprintf(stderr, "%s: grid %d x %d has more than %u states\n", path, cols, rows, MAX_STATES);
+        return false;
+    }
+
+    static signed char glyphType[256];
+    if(!glyphType[0]){
+        memset(glyphType, -1, sizeof glyphType);
+        for(int type=0;type<CELL_TYPES;type++)
+            glyphType[(unsigned char)tileBehavior[type].glyph] = type;
+    }
+    allocLevelGrid(lv, cols, rows, 0, 0);
+    for(int r=0;r<rows;r++){
+        line = nextLine(p, end, lineNo);
+        if(!line || (int)strlen(line)<cols){
+            fprintf(stderr, "%s:%d: grid row shorter than %d\n", path, lineNo, cols);
+            return false;
+        }
+        unsigned char *row = &lv.cells[(r+GRID_BORDER)*lv.cols + GRID_BORDER];
+        for(int c=0;c<cols;c++){
+            int type = glyphType[(unsigned char)line[c]];
+            if(type<0){
+                fprintf(stderr, "%s:%d: unknown tile '%c'\n", path, lineNo, line[c]);
+                return false;
+            }
+            row[c] = type;
+        }
+    }
+
+    int haveStart = 0, haveHole = 0, haveActions = 0;
+    while((line = nextLine(p, end, lineNo))){
+        int c, r, s, tc = 0, tr = 0;
+        float x, z;
+        char op[16];
+        if(line[0]==0 || line[0]=='#')
+            continue;
+        if(sscanf(line, "origin %f %f", &x, &z)==2){
+            lv.x0 = x - GRID_BORDER*TILE_SIZE;
+            lv.z0 = z - GRID_BORDER*TILE_SIZE;
+            continue;
+        }
+        if(sscanf(line, "action %d %15s %d", &s, op, &c)==3){
+            int code = -1;
+            for(int i=0;i<3;i++)
+                if(!strcmp(op, actionNames[i]))
+                    code = i;
+            if(code<0 || s<0 || s>=lv.numSwitches || c<0 || c>=MAX_GATES){
+                fprintf(stderr, "%s:%d: bad action '%s'\n", path, lineNo, line);
+                return false;
+            }
+            addAction(lv, s, code, c);
+            haveActions = 1;
+            continue;
+        }
+        if(sscanf(line, "start %d %d", &c, &r)==2)
+            haveStart = 1;
+        else if(sscanf(line, "hole %d %d", &c, &r)==2)
+            haveHole = 1;
+        else if(sscanf(line, "bridge %d %d %d", &c, &r, &s)==3)
+            ;
+        else if(sscanf(line, "teleport %d %d %d %d", &c, &r, &tc, &tr)==4)
+            ;
+        else if(sscanf(line, "switch %d %d", &c, &r)==2)
+            ;
+        else{
+            fprintf(stderr, "%s:%d: cannot parse '%s'\n", path, lineNo, line);
+            return false;
+        }
+        if(c<0 || r<0 || c>=cols || r>=rows || tc<0 || tr<0 || tc>=cols || tr>=rows){
+            fprintf(stderr, "%s:%d: cell outside the grid\n", path, lineNo);
+            return false;
+        }
+        int cell = (r+GRID_BORDER)*lv.cols + c + GRID_BORDER;
+        switch(line[0]){
+            case 's':
+                if(line[1]=='t')
+                    lv.start = cell;
+                else if(lv.numSwitches==MAX_SWITCHES){
+                    fprintf(stderr, "%s:%d: more than %d switches\n", path, lineNo, MAX_SWITCHES);
+                    return false;
+                }
+                else
+                    addSwitchCell(lv, cell);
+                break;
+            case 'h':
+                lv.goal = cell;
+                lv.cells[cell] = CELL_GOAL;
+                break;
+            case 'b':
+                if(s<0 || s>=MAX_GATES){
+                    fprintf(stderr, "%s:%d: gate %d out of range\n", path, lineNo, s);
+                    return false;
+                }
+                lv.gate[cell] = s;
+                lv.numGates = max(lv.numGates, s+1);
+                break;
+            case 't':
+                addTeleport(lv, cell, (tr+GRID_BORDER)*lv.cols + tc + GRID_BORDER);
+                break;
+        }
+    }
+    if(!haveStart || !haveHole){
+        fprintf(stderr, "%s: missing %s\n", path, haveStart ? "hole" : "start");
+        return false;
+    }
+    /* files without a trigger graph use one gate per switch, toggled by it */
+    if(!haveActions)
+        for(int sw=0;sw<lv.numSwitches;sw++)
+            addAction(lv, sw, ACTION_TOGGLE, sw);
+    unsigned int opened = 0;
+    for(int sw=0;sw<lv.numSwitches;sw++)
+        for(size_t i=0;i<lv.triggers[sw].actions.size();i++)
+            if(lv.triggers[sw].actions[i].op!=ACTION_CLOSE)
+                opened |= 1u << lv.triggers[sw].actions[i].gate;
+    for(int cell=0;cell<lv.cols*lv.rows;cell++){
+        const char *problem = NULL;
+        if(lv.cells[cell]==CELL_BRIDGE && (lv.gate[cell]<0 || !((opened >> lv.gate[cell]) & 1)))
+            problem = "bridge has no switch";
+        else if((lv.cells[cell]==CELL_SWITCH_HEAVY || lv.cells[cell]==CELL_SWITCH_SOFT) && lv.trigger[cell]<0)
+            problem = "switch has no 'switch' line";
+        else if(lv.cells[cell]==CELL_TELEPORT && lv.link[cell]<0)
+            problem = "teleport has no target";
+        if(problem){
+            fprintf(stderr, "%s: %s at %d %d\n", path, problem, cell % lv.cols - GRID_BORDER, cell / lv.cols - GRID_BORDER);
+            return false;
+        }
+    }
+    if(!assignCrumbleGates(lv)){
+        fprintf(stderr, "%s: more than %d gates and crumbling tiles\n", path, MAX_GATES);
+        return false;
     }
+    if(!levelFits(lv.cols, lv.rows, lv.numGates)){
+        fprintf(stderr, "%s: %d gates on a %d x %d grid make more than %u states\n", path, lv.numGates, cols, rows, MAX_STATES);
+        return false;
+    }
+    return true;
+}
+
+/* Read a level file into lv with one read and parse it in place */
+bool readLevelText(Level &lv, const char *path){
+    FILE *f = fopen(path, "rb");
+    if(!f){
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    vector<char> text(size+1);
+    size_t got = fread(&text[0], 1, size, f);
+    fclose(f);
+    text[got] = 0;
+    return parseLevelText(lv, &text[0], got, path);
+}
 
+/**************************
+ * Level packs            *
+ **************************/
 
-    for(map<string,Sprite>::iterator it1=label.begin();it1!=label.end();it1++){
-        string current = it1->first; 
+/* A pack is the levels of a game in one file that is mapped and read in place:
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+       PackHeader | uint64 offsets[count+1] | PackLevel 0 | PackLevel 1 | ...
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+   Level i is the bytes [offsets[i], offsets[i+1]), 8-byte aligned. A PackLevel is followed
+   by its compressed cells, then as int32: the cell of each switch, (cell, gate) pairs for
+   bridges and crumbling tiles, teleport pairs and trigger actions. The cells are either
+   (type, run) byte pairs or a dictionary of the types used and 1, 2 or 4-bit codes,
+   whichever is smaller. Everything is native-endian */
+#define PACK_MAGIC "BLXP"
+#define PACK_VERSION 2
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
+enum { PACK_CELLS_RLE=0, PACK_CELLS_BITS };
 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+struct PackHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+};
+typedef struct PackHeader PackHeader;
+
+struct PackLevel {
+    int32_t cols, rows;        // including the border
+    float x0, z0;
+    int32_t start, goal;
+    int32_t numSwitches, numGates;
+    int32_t numGated;          // (cell, gate) pairs
+    int32_t numTeleports;      // (from, to) cell pairs
+    int32_t numActions;        // (switch, op, gate) triples
+    int32_t encoding;          // PACK_CELLS_*
+    int32_t cellBytes;
+    int32_t reserved;
+};
+typedef struct PackLevel PackLevel;
+
+/* Where the parts of one level sit inside the mapping */
+struct PackLevelView {
+    const PackLevel *head;
+    const unsigned char *cellData;
+    const int32_t *switchCells;
+    const int32_t *gated;
+    const int32_t *teleports;
+    const int32_t *actions;
+};
+typedef struct PackLevelView PackLevelView;
 
-        Matrices.model = glm::mat4(1.0f);
+struct LevelPack {
+    const char *base;
+    size_t size;
+    uint32_t count;
+    const uint64_t *offsets;
+};
+typedef struct LevelPack LevelPack;
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(label[current].x,label[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(label[current].object);
+static size_t packLevelBytes(const PackLevel &pl){
+    size_t bytes = (sizeof(PackLevel) + pl.cellBytes + 3) & ~(size_t)3;
+    return bytes + ((size_t)pl.numSwitches + 2*(size_t)pl.numGated + 2*(size_t)pl.numTeleports + 3*(size_t)pl.numActions)*sizeof(int32_t);
+}
+
+/* (type, run) pairs in row-major order, runs of up to 255 cells */
+void encodeCellsRLE(const unsigned char *cells, int n, vector<unsigned char> &out){
+    out.clear();
+    for(int i=0;i<n;){
+        int run = 1;
+        while(i+run<n && run<255 && cells[i+run]==cells[i])
+            run++;
+        out.push_back(cells[i]);
+        out.push_back(run);
+        i += run;
+    }
+}
+
+/* Bits per code for a dictionary of 'types' entries */
+static int packCodeBits(int types){
+    return (types<=2) ? 1 : (types<=4) ? 2 : 4;
+}
+
+/* The number of types used, the types, then one code per cell packed low bits first */
+void encodeCellsBits(const unsigned char *cells, int n, vector<unsigned char> &out){
+    int code[256], types = 0;
+    unsigned char dict[CELL_TYPES];
+    memset(code, -1, sizeof code);
+    for(int i=0;i<n;i++)
+        if(code[cells[i]]<0){
+            code[cells[i]] = types;
+            dict[types++] = cells[i];
+        }
+    int bits = packCodeBits(types);
+    out.assign(1 + types + ((size_t)n*bits + 7)/8, 0);
+    out[0] = types;
+    memcpy(&out[1], dict, types);
+    unsigned char *packed = &out[1+types];
+    for(int i=0;i<n;i++)
+        packed[(size_t)i*bits/8] |= code[cells[i]] << ((size_t)i*bits % 8);
+}
+
+/* Expand the cells of a view into out[cols*rows]; false if they don't fill it exactly */
+bool decodeCells(const PackLevelView &view, unsigned char *out){
+    const PackLevel &pl = *view.head;
+    const unsigned char *p = view.cellData, *end = p + pl.cellBytes;
+    size_t n = (size_t)pl.cols*pl.rows, filled = 0;
+
+    if(pl.encoding==PACK_CELLS_RLE){
+        /* Most runs are short, so a run of up to 8 is one 8-byte store rather than a memset
+           call; the bytes it writes past the run belong to the runs after it and are
+           overwritten by them. Near the end of the grid it falls back to memset */
+        for(;p+1<end;p+=2){
+            unsigned int type = p[0], run = p[1];
+            if(type>=CELL_TYPES || filled+run>n)
+                return false;
+            if(run<=8 && filled+8<=n){
+                uint64_t fill = type*0x0101010101010101ull;
+                memcpy(out+filled, &fill, 8);
+            }
+            else
+                memset(out+filled, type, run);
+            filled += run;
+        }
+        return filled==n && p==end;
+    }
+    if(pl.encoding!=PACK_CELLS_BITS || p==end)
+        return false;
+    int types = p[0];
+    if(types<1 || types>CELL_TYPES || end-p!=(ptrdiff_t)(1 + types + (n*packCodeBits(types) + 7)/8))
+        return false;
+    for(int t=0;t<types;t++)
+        if(p[1+t]>=CELL_TYPES)
+            return false;
+
+    /* every byte expands to 8/bits cells through one table lookup */
+    int bits = packCodeBits(types), perByte = 8/bits;
+    unsigned char expand[256][8];
+    for(int b=0;b<256;b++)
+        for(int k=0;k<perByte;k++){
+            int c = (b >> (k*bits)) & ((1<<bits)-1);
+            expand[b][k] = (c<types) ? p[1+c] : p[1];
+        }
+    const unsigned char *packed = p+1+types;
+    size_t whole = n/perByte;
+    for(size_t i=0;i<whole;i++)
+        memcpy(out + i*perByte, expand[packed[i]], perByte);
+    if(n % perByte)
+        memcpy(out + whole*perByte, expand[packed[whole]], n % perByte);
+    return true;
+}
+
+bool writeLevelPack(const char *path, const vector<Level> &lvls){
+    FILE *out = fopen(path, "wb");
+    if(!out){
+        fprintf(stderr, "%s: cannot create\n", path);
+        return false;
+    }
+    PackHeader head = {};
+    memcpy(head.magic, PACK_MAGIC, 4);
+    head.version = PACK_VERSION;
+    head.count = lvls.size();
+    vector<uint64_t> offsets(lvls.size()+1);
+    offsets[0] = sizeof(PackHeader) + offsets.size()*sizeof(uint64_t);
+    vector< vector<char> > records(lvls.size());
+    for(size_t i=0;i<lvls.size();i++){
+        const Level &lv = lvls[i];
+        int cells = lv.cols*lv.rows;
+        vector<int32_t> tail(lv.numSwitches, 0), gated, teleports, actions;
+        for(int cell=0;cell<cells;cell++){
+            if(lv.trigger[cell]>=0)
+                tail[lv.trigger[cell]] = cell;
+            if(lv.gate[cell]>=0){
+                gated.push_back(cell);
+                gated.push_back(lv.gate[cell]);
+            }
+            if(lv.link[cell]>=0){
+                teleports.push_back(cell);
+                teleports.push_back(lv.link[cell]);
+            }
+        }
+        for(int sw=0;sw<lv.numSwitches;sw++)
+            for(size_t a=0;a<lv.triggers[sw].actions.size();a++){
+                actions.push_back(sw);
+                actions.push_back(lv.triggers[sw].actions[a].op);
+                actions.push_back(lv.triggers[sw].actions[a].gate);
+            }
+        tail.insert(tail.end(), gated.begin(), gated.end());
+        tail.insert(tail.end(), teleports.begin(), teleports.end());
+        tail.insert(tail.end(), actions.begin(), actions.end());
+
+        vector<unsigned char> rle, bits;
+        encodeCellsRLE(&lv.cells[0], cells, rle);
+        encodeCellsBits(&lv.cells[0], cells, bits);
+        vector<unsigned char> &data = (rle.size()<=bits.size()) ? rle : bits;
+        PackLevel pl = { lv.cols, lv.rows, lv.x0, lv.z0, lv.start, lv.goal, lv.numSwitches, lv.numGates,
+                         (int32_t)gated.size()/2, (int32_t)teleports.size()/2, (int32_t)actions.size()/3,
+                         (rle.size()<=bits.size()) ? PACK_CELLS_RLE : PACK_CELLS_BITS, (int32_t)data.size(), 0 };
+
+        vector<char> &rec = records[i];
+        rec.assign((packLevelBytes(pl) + 7) & ~(size_t)7, 0);
+        memcpy(&rec[0], &pl, sizeof pl);
+        memcpy(&rec[sizeof pl], &data[0], data.size());
+        size_t at = (sizeof pl + data.size() + 3) & ~(size_t)3;
+        if(!tail.empty())
+            memcpy(&rec[at], &tail[0], tail.size()*sizeof(int32_t));
+        offsets[i+1] = offsets[i] + rec.size();
+    }
+    fwrite(&head, sizeof head, 1, out);
+    fwrite(&offsets[0], sizeof(uint64_t), offsets.size(), out);
+    for(size_t i=0;i<records.size();i++)
+        fwrite(&records[i][0], 1, records[i].size(), out);
+    bool ok = !ferror(out);
+    ok = (fclose(out)==0) && ok;
+    if(!ok)
+        fprintf(stderr, "%s: write failed\n", path);
+    return ok;
+}
+
+/* Map a pack and check its header and index; nothing else is read until a level is asked for */
+bool openLevelPack(LevelPack &pack, const char *path){
+    int fd = open(path, O_RDONLY);
+    if(fd<0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st)<0 || (size_t)st.st_size<sizeof(PackHeader)){
+        close(fd);
+        fprintf(stderr, "%s: not a level pack\n", path);
+        return false;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base==MAP_FAILED){
+        fprintf(stderr, "%s: cannot map\n", path);
+        return false;
+    }
+    pack.base = (const char*)base;
+    pack.size = st.st_size;
+    const PackHeader *head = (const PackHeader*)base;
+    pack.count = head->count;
+    pack.offsets = (const uint64_t*)(pack.base + sizeof(PackHeader));
+    bool ok = memcmp(head->magic, PACK_MAGIC, 4)==0 && head->version==PACK_VERSION &&
+              ((size_t)pack.count+1)*sizeof(uint64_t) <= pack.size - sizeof(PackHeader);
+    ok = ok && pack.offsets[pack.count] <= pack.size;
+    for(uint32_t i=0;ok && i<pack.count;i++)
+        ok = pack.offsets[i] <= pack.offsets[i+1] && pack.offsets[i] % 8==0;
+    if(!ok){
+        fprintf(stderr, "%s: not a level pack\n", path);
+        munmap(base, pack.size);
+        return false;
+    }
+    return true;
+}
+
+void closeLevelPack(LevelPack &pack){
+    munmap((void*)pack.base, pack.size);
+    pack.base = NULL;
+    pack.count = 0;
+}
+
+/* Point a view at level n of the pack: a bounds check and some pointer arithmetic */
+bool packLevel(const LevelPack &pack, uint32_t n, PackLevelView &view){
+    if(n>=pack.count)
+        return false;
+    const char *p = pack.base + pack.offsets[n];
+    size_t size = pack.offsets[n+1] - pack.offsets[n];
+    if(size<sizeof(PackLevel))
+        return false;
+    const PackLevel &pl = *(const PackLevel*)p;
+    if(pl.cols<=0 || pl.rows<=0 || pl.numSwitches<0 || pl.numGated<0 || pl.numTeleports<0 || pl.numActions<0 ||
+       pl.cellBytes<0 || packLevelBytes(pl) > size)
+        return false;
+    view.head = &pl;
+    view.cellData = (const unsigned char*)(p + sizeof(PackLevel));
+    view.switchCells = (const int32_t*)(p + ((sizeof(PackLevel) + pl.cellBytes + 3) & ~(size_t)3));
+    view.gated = view.switchCells + pl.numSwitches;
+    view.teleports = view.gated + 2*pl.numGated;
+    view.actions = view.teleports + 2*pl.numTeleports;
+    return true;
+}
+
+/* Fill a Level for the rules from a view, decoding the cells straight into its grid.
+   False when the record points outside its level or its lists don't match its cells */
+bool levelFromPack(Level &lv, const PackLevelView &view){
+    const PackLevel &pl = *view.head;
+    if(!levelFits(pl.cols, pl.rows, pl.numGates))
+        return false;       // more states than the table budget
+    int cells = pl.cols*pl.rows;
+    bool ok = pl.start>=0 && pl.start<cells && pl.goal>=0 && pl.goal<cells && pl.numSwitches<=MAX_SWITCHES;
+    for(int i=0;ok && i<pl.numSwitches;i++)
+        ok = view.switchCells[i]>=0 && view.switchCells[i]<cells;
+    for(int i=0;ok && i<pl.numGated;i++)
+        ok = view.gated[2*i]>=0 && view.gated[2*i]<cells && view.gated[2*i+1]>=0 && view.gated[2*i+1]<pl.numGates;
+    for(int i=0;ok && i<pl.numTeleports;i++)
+        ok = view.teleports[2*i]>=0 && view.teleports[2*i]<cells && view.teleports[2*i+1]>=0 && view.teleports[2*i+1]<cells;
+    for(int i=0;ok && i<pl.numActions;i++)
+        ok = view.actions[3*i]>=0 && view.actions[3*i]<pl.numSwitches && view.actions[3*i+1]>=0 && view.actions[3*i+1]<3 &&
+             view.actions[3*i+2]>=0 && view.actions[3*i+2]<pl.numGates;
+    if(!ok)
+        return false;
+    lv.cols = pl.cols;
+    lv.rows = pl.rows;
+    lv.x0 = pl.x0;
+    lv.z0 = pl.z0;
+    lv.cells.resize(cells);
+    if(!decodeCells(view, &lv.cells[0]))
+        return false;
+    lv.gate.assign(cells, -1);
+    for(int i=0;i<pl.numGated;i++)
+        lv.gate[view.gated[2*i]] = view.gated[2*i+1];
+    lv.trigger.assign(cells, -1);
+    for(int i=0;i<pl.numSwitches;i++)
+        lv.trigger[view.switchCells[i]] = i;
+    lv.link.assign(cells, -1);
+    for(int i=0;i<pl.numTeleports;i++)
+        lv.link[view.teleports[2*i]] = view.teleports[2*i+1];
+    lv.numSwitches = pl.numSwitches;
+    lv.numGates = pl.numGates;
+    lv.triggers.assign(pl.numSwitches, Trigger());
+    for(int i=0;i<pl.numActions;i++){
+        TriggerAction a = { view.actions[3*i+1], view.actions[3*i+2] };
+        lv.triggers[view.actions[3*i]].actions.push_back(a);
+    }
+    lv.start = pl.start;
+    lv.goal = pl.goal;
+    lv.table.clear();
+    /* every bridge and crumbling tile has a gate, every switch a trigger, every teleport a target */
+    for(int cell=0;cell<cells;cell++){
+        int type = lv.cells[cell];
+        if(((type==CELL_BRIDGE || type==CELL_CRUMBLING) && lv.gate[cell]<0) ||
+           ((type==CELL_SWITCH_HEAVY || type==CELL_SWITCH_SOFT) && lv.trigger[cell]<0) ||
+           (type==CELL_TELEPORT && lv.link[cell]<0))
+            return false;
+    }
+    return true;
+}
+
+/* A level path is a .lvl file or 'file.pack:n' for level n of a pack */
+bool readLevelPath(Level &lv, const string &path){
+    size_t colon = path.rfind(".pack:");
+    if(colon==string::npos)
+        return readLevelText(lv, path.c_str());
+    string file = path.substr(0, colon+5);
+    LevelPack pack;
+    PackLevelView view;
+    if(!openLevelPack(pack, file.c_str())){
+        fprintf(stderr, "%s: cannot open\n", file.c_str());
+        return false;
+    }
+    bool ok = packLevel(pack, atoi(path.c_str()+colon+6), view) && levelFromPack(lv, view);
+    if(!ok)
+        fprintf(stderr, "%s: no such level in the pack, or a damaged one\n", path.c_str());
+    closeLevelPack(pack);
+    return ok;
+}
+
+/**************************
+ * Level generator        *
+ **************************/
+
+/* Reachable part of the state graph from the start: size and average number of safe rolls */
+struct LevelStats {
+    unsigned long reachable;
+    double branching;
+};
+typedef struct LevelStats LevelStats;
+
+void measureLevel(const Level &lv, unsigned int start, LevelStats &stats){
+    vector<unsigned char> seen(numStates(lv), 0);
+    vector<unsigned int> queue(1, start);
+    unsigned long safeMoves = 0;
+    seen[start] = 1;
+    for(size_t head=0;head<queue.size();head++){
+        unsigned int s = queue[head];
+        for(int m=0;m<4;m++){
+            Transition t = lv.table[(size_t)s*4+m];
+            if(t.outcome!=STEP_OK && t.outcome!=STEP_GOAL)
+                continue;
+            safeMoves++;
+            if(t.outcome==STEP_OK && !seen[t.next]){
+                seen[t.next] = 1;
+                queue.push_back(t.next);
+            }
+        }
+    }
+    stats.reachable = queue.size();
+    stats.branching = (double)safeMoves / queue.size();
+}
+
+struct GenParams {
+    int minCols, maxCols, minRows, maxRows;
+    int minMoves;       // reject levels solved in fewer rolls
+    int maxSwitches;
+    double fragileRate;
+};
+typedef struct GenParams GenParams;
+
+struct GenLevel {
+    unsigned long seed;
+    Level level;
+    int moves;
+    LevelStats stats;
+};
+typedef struct GenLevel GenLevel;
+
+/* One candidate from a seed: a random-walk island with a hole at its far end, some fragile
+   tiles and switch-raised bridges. Returns false when the solver rejects it, or when a
+   switch's bridges are not on every solution. */
+bool generateLevel(unsigned long seed, const GenParams &p, GenLevel &out){
+    mt19937 rng(seed);
+    int cols = p.minCols + rng() % (p.maxCols - p.minCols + 1);
+    int rows = p.minRows + rng() % (p.maxRows - p.minRows + 1);
+    Level &lv = out.level;
+    allocLevelGrid(lv, cols, rows, 0, 0);
+
+    /* carve: random walk of 2x2 stamps, so the block always has room to turn */
+    vector<int> tiles;
+    int c = rng() % (cols-1), r = rng() % (rows-1);
+    int steps = cols*rows/2;
+    for(int i=0;i<steps;i++){
+        for(int dr=0;dr<2;dr++)
+            for(int dc=0;dc<2;dc++){
+                int cell = (r+dr+GRID_BORDER)*lv.cols + c+dc+GRID_BORDER;
+                if(lv.cells[cell]==CELL_EMPTY){
+                    lv.cells[cell] = CELL_NORMAL;
+                    tiles.push_back(cell);
+                }
+            }
+        switch(rng() % 4){
+            case 0: if(c>0) c--; break;
+            case 1: if(c<cols-2) c++; break;
+            case 2: if(r>0) r--; break;
+            case 3: if(r<rows-2) r++; break;
+        }
+    }
+    if(tiles.size()<8)
+        return false;
+
+    /* start anywhere, hole on the tile farthest from it */
+    lv.start = tiles[rng() % tiles.size()];
+    lv.goal = lv.start;
+    vector<int> dist;
+    relaxedDistances(lv, dist);
+    for(size_t i=0;i<tiles.size();i++)
+        if(dist[tiles[i]]>dist[lv.goal])
+            lv.goal = tiles[i];
+    if(lv.goal==lv.start)
+        return false;
+    lv.cells[lv.goal] = CELL_GOAL;
+
+    for(size_t i=0;i<tiles.size();i++)
+        if(tiles[i]!=lv.start && lv.cells[tiles[i]]==CELL_NORMAL && (rng() % 1000) < p.fragileRate*1000)
+            lv.cells[tiles[i]] = CELL_FRAGILE;
+
+    /* each switch raises one or two neighbouring bridge tiles somewhere else on the island */
+    int switches = rng() % (p.maxSwitches + 1);
+    for(int sw=0;sw<switches;sw++){
+        int bridge = tiles[rng() % tiles.size()];
+        int trigger = tiles[rng() % tiles.size()];
+        if(bridge==lv.start || bridge==lv.goal || lv.cells[bridge]!=CELL_NORMAL || lv.trigger[bridge]>=0)
+            continue;
+        if(trigger==bridge || lv.cells[trigger]!=CELL_NORMAL || lv.trigger[trigger]>=0)
+            continue;
+        int gate = addSwitchCell(lv, trigger);
+        addAction(lv, gate, ACTION_TOGGLE, gate);
+        lv.cells[bridge] = CELL_BRIDGE;
+        lv.gate[bridge] = gate;
+        int second = bridge + ((rng() & 1) ? 1 : lv.cols);
+        if(second!=lv.start && lv.cells[second]==CELL_NORMAL && lv.trigger[second]<0 && second!=trigger){
+            lv.cells[second] = CELL_BRIDGE;
+            lv.gate[second] = gate;
+        }
+    }
+
+    if(!compileTransitions(lv))
+        return false;
+    SolveResult res;
+    unsigned int start = makeState(lv, lv.start, STANDING, 0);
+    solveLevel(lv, start, SOLVE_BFS, res);
+    if(res.length < p.minMoves)
+        return false;
+    /* a switch whose bridges the level can be solved without is decoration: re-roll */
+    for(int sw=0;sw<lv.numSwitches;sw++)
+        if(!bridgesNeeded(lv, sw))
+            return false;
+
+    out.seed = seed;
+    out.moves = res.length;
+    measureLevel(lv, start, out.stats);
+    return true;
+}
+
+/* Generate 'count' solvable levels from candidate seeds base, base+1, ... on several threads.
+   The kept levels are the accepted candidates with the lowest seeds, so a run is repeatable. */
+void generateLevels(int count, unsigned long base, int threads, const GenParams &p, vector<GenLevel> &out){
+    atomic<unsigned long> nextSeed(base);
+    atomic<int> accepted(0);
+    mutex lock;
+    vector<thread> workers;
+
+    for(int w=0;w<threads;w++){
+        workers.push_back(thread([&]{
+            GenLevel candidate;
+            while(accepted.load() < count){
+                unsigned long seed = nextSeed++;
+                if(!generateLevel(seed, p, candidate))
+                    continue;
+                lock_guard<mutex> guard(lock);
+                out.push_back(candidate);
+                accepted++;
+            }
+        }));
+    }
+    for(size_t w=0;w<workers.size();w++)
+        workers[w].join();
+
+    sort(out.begin(), out.end(), [](const GenLevel &a, const GenLevel &b){ return a.seed < b.seed; });
+    if((int)out.size() > count)
+        out.resize(count);
+}
+
+
+/**************************
+ * Playtest bots          *
+ **************************/
+
+enum { AGENT_GREEDY=0, AGENT_SOFTMAX };
+
+/* Exact rolls-to-goal for every state reachable from start (INT_MAX where the hole
+   cannot be reached), by a forward sweep and then a backward BFS over the table */
+void goalDistances(const Level &lv, unsigned int start, vector<int> &dist){
+    dist.assign(numStates(lv), INT_MAX);
+    vector<unsigned char> seen(numStates(lv), 0);
+    vector<unsigned int> order(1, start);
+    seen[start] = 1;
+    for(size_t head=0;head<order.size();head++)
+        for(int m=0;m<4;m++){
+            Transition t = lv.table[(size_t)order[head]*4+m];
+            if(t.outcome==STEP_OK && !seen[t.next]){
+                seen[t.next] = 1;
+                order.push_back(t.next);
+            }
+        }
+
+    /* reverse edges of the reachable subgraph, in compressed rows */
+    unordered_map<unsigned int, int> index;
+    for(size_t i=0;i<order.size();i++)
+        index[order[i]] = i;
+    vector<int> first(order.size()+1, 0), from;
+    for(size_t i=0;i<order.size();i++)
+        for(int m=0;m<4;m++){
+            Transition t = lv.table[(size_t)order[i]*4+m];
+            if(t.outcome==STEP_OK)
+                first[index[t.next]+1]++;
+        }
+    for(size_t i=0;i<order.size();i++)
+        first[i+1] += first[i];
+    from.resize(first[order.size()]);
+    vector<int> fill(first.begin(), first.end()-1);
+    vector<int> queue;
+    for(size_t i=0;i<order.size();i++)
+        for(int m=0;m<4;m++){
+            Transition t = lv.table[(size_t)order[i]*4+m];
+            if(t.outcome==STEP_OK)
+                from[fill[index[t.next]]++] = i;
+            else if(t.outcome==STEP_GOAL && dist[order[i]]==INT_MAX){
+                dist[order[i]] = 1;
+                queue.push_back(i);
+            }
+        }
+    for(size_t head=0;head<queue.size();head++){
+        int i = queue[head];
+        for(int k=first[i];k<first[i+1];k++){
+            unsigned int p = order[from[k]];
+            if(dist[p]==INT_MAX){
+                dist[p] = dist[order[i]] + 1;
+                queue.push_back(from[k]);
+            }
+        }
+    }
+}
+
+struct BotParams {
+    int agent;
+    double epsilon;       // greedy: chance of a uniformly random roll
+    double temperature;   // softmax: spread over the distance change of each roll
+    double fallPenalty;   // softmax: how many rolls a fall "costs" in the agent's eyes
+    int moveBudget;       // a bot that has not solved after this many rolls gives up
+};
+typedef struct BotParams BotParams;
+
+struct BotReport {
+    int bots, solved;
+    unsigned long falls, breaks;
+    vector<int> solveMoves;   // rolls used by each bot that solved
+};
+typedef struct BotReport BotReport;
+
+/* Play one bot to the hole or until it gives up; falls and fragile breaks restart it at the
+   start with the switches reset, as in the game */
+void playBot(const Level &lv, unsigned int start, const vector<int> &dist, const BotParams &p, unsigned long seed, BotReport &rep){
+    mt19937_64 rng(seed);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    unsigned int s = start;
+    for(int moves=1;moves<=p.moveBudget;moves++){
+        int choice = 0;
+        if(p.agent==AGENT_GREEDY){
+            if(unit(rng) < p.epsilon)
+                choice = rng() % 4;
+            else{
+                int best = INT_MAX;
+                for(int m=0;m<4;m++){
+                    Transition t = lv.table[(size_t)s*4+m];
+                    int d = (t.outcome==STEP_GOAL) ? 0 : (t.outcome==STEP_OK ? dist[t.next] : INT_MAX);
+                    if(d<best || (d==best && (rng() & 1))){
+                        best = d;
+                        choice = m;
+                    }
+                }
+            }
+        }
+        else{
+            double weight[4], total = 0;
+            int here = dist[s]==INT_MAX ? 1000 : dist[s];
+            for(int m=0;m<4;m++){
+                Transition t = lv.table[(size_t)s*4+m];
+                double d;
+                if(t.outcome==STEP_GOAL)
+                    d = 0;
+                else if(t.outcome==STEP_OK)
+                    d = dist[t.next]==INT_MAX ? here + p.fallPenalty : dist[t.next];
+                else
+                    d = here + p.fallPenalty;
+                weight[m] = exp(-(d - here)/p.temperature);
+                total += weight[m];
+            }
+            double pick = unit(rng)*total;
+            for(choice=0;choice<3 && pick>=weight[choice];choice++)
+                pick -= weight[choice];
+        }
+
+        Transition t = lv.table[(size_t)s*4+choice];
+        if(t.outcome==STEP_GOAL){
+            rep.solved++;
+            rep.solveMoves.push_back(moves);
+            return;
+        }
+        if(t.outcome==STEP_BREAK)
+            rep.breaks++;
+        if(t.outcome!=STEP_OK){
+            rep.falls++;
+            s = start;
+        }
+        else
+            s = t.next;
+    }
+}
+
+/* Run 'bots' bots on one level over several threads. Bot i always uses seed (seed, i),
+   so reports do not depend on the thread count. */
+void playtestLevel(const Level &lv, int bots, unsigned long seed, int threads, const BotParams &p, BotReport &rep){
+    unsigned int start = makeState(lv, lv.start, STANDING, 0);
+    vector<int> dist;
+    goalDistances(lv, start, dist);
+
+    vector<BotReport> parts(threads);
+    vector<thread> workers;
+    for(int w=0;w<threads;w++){
+        workers.push_back(thread([&, w]{
+            BotReport &part = parts[w];
+            part.bots = part.solved = 0;
+            part.falls = part.breaks = 0;
+            for(int i=w;i<bots;i+=threads){
+                part.bots++;
+                playBot(lv, start, dist, p, seed*0x9E3779B97F4A7C15ull + i, part);
+            }
+        }));
+    }
+    for(size_t w=0;w<workers.size();w++)
+        workers[w].join();
+
+    rep.bots = rep.solved = 0;
+    rep.falls = rep.breaks = 0;
+    rep.solveMoves.clear();
+    for(int w=0;w<threads;w++){
+        rep.bots += parts[w].bots;
+        rep.solved += parts[w].solved;
+        rep.falls += parts[w].falls;
+        rep.breaks += parts[w].breaks;
+        rep.solveMoves.insert(rep.solveMoves.end(), parts[w].solveMoves.begin(), parts[w].solveMoves.end());
+    }
+    sort(rep.solveMoves.begin(), rep.solveMoves.end());
+}
+
+
+/**************************
+ * Level validator        *
+ **************************/
+
+struct LintIssue {
+    const char *check;
+    int col, row;        // level file coordinates, -1 when the issue is not about a cell
+    int sw;              // switch index, -1 when not about a switch
+};
+
+struct LintReport {
+    string name;
+    int moves;                 // optimal solution, -1 if unsolvable
+    unsigned long reachable;   // reachable states
+    vector<LintIssue> errors, warnings;
+};
+typedef struct LintReport LintReport;
+
+static void addIssue(vector<LintIssue> &list, const Level &lv, const char *check, int cell, int sw){
+    LintIssue issue = { check, -1, -1, sw };
+    if(cell>=0){
+        issue.col = cell % lv.cols - GRID_BORDER;
+        issue.row = cell / lv.cols - GRID_BORDER;
+    }
+    list.push_back(issue);
+}
+
+/* Reachability and dead-tile analysis of one compiled level */
+void validateLevel(const Level &lv, LintReport &rep){
+    int ncells = lv.cols*lv.rows;
+    unsigned int start = makeState(lv, lv.start, STANDING, 0);
+    rep.moves = -1;
+    rep.reachable = 0;
+
+    /* cells that can hold the block in some orientation under some gate state */
+    vector<unsigned char> canHold(ncells, 0);
+    for(unsigned int bits=0;bits < (1u << lv.numGates);bits++){
+        PlacementMasks pm;
+        computePlacementMasks(lv, bits, pm);
+        for(int cell=0;cell<ncells;cell++){
+            int col = cell % lv.cols, row = cell / lv.cols;
+            if(maskBit(pm.stand,pm.words,row,col) || maskBit(pm.lyingX,pm.words,row,col) || maskBit(pm.lyingZ,pm.words,row,col)
+               || (col>0 && maskBit(pm.lyingX,pm.words,row,col-1)) || (row>0 && maskBit(pm.lyingZ,pm.words,row-1,col)))
+                canHold[cell] = 1;
+        }
     }
 
-    int poi = abs(moves);
+    PlacementMasks initial;
+    computePlacementMasks(lv, 0, initial);
+    if(placementOutcome(lv, initial, lv.start, STANDING)!=STEP_OK){
+        addIssue(rep.errors, lv, "start-unsupported", lv.start, -1);
+        return;
+    }
 
-    int one;
+    vector<int> dist;
+    goalDistances(lv, start, dist);
+    if(dist[start]!=INT_MAX)
+        rep.moves = dist[start];
+    else
+        addIssue(rep.errors, lv, "hole-unreachable", lv.goal, -1);
+
+    /* walk every reachable state and note how each cell gets covered */
+    vector<unsigned char> covered(ncells, 0), live(ncells, 0), lying(ncells, 0), brokenStanding(ncells, 0);
+    vector<unsigned char> pressed(lv.numSwitches, 0);
+    vector<unsigned char> seen(numStates(lv), 0);
+    vector<unsigned int> queue(1, start);
+    seen[start] = 1;
+    for(size_t head=0;head<queue.size();head++){
+        unsigned int s = queue[head];
+        int cell = stateCell(lv, s);
+        int orientation = stateOrientation(lv, s);
+        int other = (orientation==LYING_X) ? cell+1 : (orientation==LYING_Z ? cell+lv.cols : cell);
+        covered[cell] = covered[other] = 1;
+        if(dist[s]!=INT_MAX)
+            live[cell] = live[other] = 1;
+        if(orientation!=STANDING)
+            lying[cell] = lying[other] = 1;
+        int ends[2] = { cell, other };
+        for(int i=0;i<2;i++){
+            int press = tileBehavior[lv.cells[ends[i]]].press;
+            if(press==PRESS_ANY || (press==PRESS_STANDING && orientation==STANDING))
+                pressed[lv.trigger[ends[i]]] = 1;
+        }
 
-    one = poi%10;
-    if(one == 0 || one == 2 ||one == 3 ||one == 5 ||one == 6 ||one == 7 ||one == 8 ||one == 9){
-    point3["seg1"].status=1;
+        for(int m=0;m<4;m++){
+            Transition t = lv.table[(size_t)s*4+m];
+            if(t.outcome==STEP_BREAK)
+                brokenStanding[stateCell(lv, t.next)] = 1;
+            else if(t.outcome==STEP_GOAL)
+                covered[lv.goal] = live[lv.goal] = 1;
+            else if(t.outcome==STEP_OK && !seen[t.next]){
+                seen[t.next] = 1;
+                queue.push_back(t.next);
+            }
+        }
     }
-    if(one == 0 || one == 1 ||one == 2 ||one == 3 ||one == 4 ||one == 7 ||one == 8 ||one == 9){
-    point3["seg2"].status=1;
+    rep.reachable = queue.size();
+
+    for(int cell=0;cell<ncells;cell++){
+        // the block never rests on a teleport, so coverage says nothing about one
+        if(lv.cells[cell]==CELL_EMPTY || cell==lv.goal || lv.cells[cell]==CELL_TELEPORT)
+            continue;
+        if(!canHold[cell])
+            addIssue(rep.warnings, lv, "tile-never-holds-block", cell, -1);
+        else if(!covered[cell])
+            addIssue(rep.warnings, lv, "unreachable-tile", cell, -1);
+        else if(!live[cell])
+            addIssue(rep.warnings, lv, "dead-tile", cell, -1);
+        if(lv.cells[cell]==CELL_FRAGILE && brokenStanding[cell] && !lying[cell])
+            addIssue(rep.warnings, lv, "fragile-only-standing", cell, -1);
     }
-    if(one == 0 || one == 1 ||one == 3 ||one == 4 ||one == 5  ||one == 6 ||one == 7 ||one == 8 ||one == 9){
-    point3["seg3"].status=1;
+
+    /* a switch whose bridges can be deleted without making the level unsolvable is not needed */
+    for(int sw=0;sw<lv.numSwitches;sw++){
+        int switchCell = -1;
+        for(int cell=0;cell<ncells;cell++)
+            if(lv.trigger[cell]==sw)
+                switchCell = cell;
+        if(!pressed[sw]){
+            addIssue(rep.warnings, lv, "switch-unreachable", switchCell, sw);
+            continue;
+        }
+        if(rep.moves>=0 && !bridgesNeeded(lv, sw))
+            addIssue(rep.warnings, lv, "bridge-not-needed", switchCell, sw);
     }
-    if(one == 0 || one == 2 ||one == 3 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point3["seg4"].status=1;
+}
+
+static void printIssues(const vector<LintIssue> &list){
+    for(size_t i=0;i<list.size();i++){
+        printf("%s{\"check\":\"%s\"", i ? "," : "", list[i].check);
+        if(list[i].col>=0)
+            printf(",\"col\":%d,\"row\":%d", list[i].col, list[i].row);
+        if(list[i].sw>=0)
+            printf(",\"switch\":%d", list[i].sw);
+        printf("}");
     }
-    if(one == 0 || one == 2 ||one == 6 ||one == 8){
-    point3["seg5"].status=1;
+}
+
+/* One JSON object per line, in the order the levels were given */
+void printLintReport(const LintReport &rep){
+    string name;
+    for(size_t i=0;i<rep.name.size();i++){
+        if(rep.name[i]=='"' || rep.name[i]=='\\')
+            name += '\\';
+        name += rep.name[i];
     }
-    if(one == 0 || one == 4 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point3["seg6"].status=1;
+    printf("{\"level\":\"%s\",\"ok\":%s,\"moves\":%d,\"reachable\":%lu,\"errors\":[", name.c_str(),
+           rep.errors.empty() ? "true" : "false", rep.moves, rep.reachable);
+    printIssues(rep.errors);
+    printf("],\"warnings\":[");
+    printIssues(rep.warnings);
+    printf("]}\n");
+}
+
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+
+double mouse_pos_x, mouse_pos_y;
+double new_mouse_pos_x, new_mouse_pos_y;
+float angle=0;
+float xpos;
+float ypos = 2720;
+int num = 1;
+int flag =0;
+int score =0;
+int gameover=0;
+int count=0;
+float downfall =.1;
+int tileflag =0;
+int tileCell;       // the fragile tile the block broke, while tileflag is set
+int sig=0;
+
+Level levels[2];
+unsigned int blockState;
+unsigned long frameCount =0;
+
+/**************************
+ * Undo history           *
+ **************************/
+
+/* Everything needed to put the game back where it was after a roll */
+struct GameSnapshot {
+    unsigned int state;     // cell, orientation and gate bits
+    unsigned int moves;
+    int broken;             // fragile cell falling away, -1 if none
+    unsigned char level;
+};
+typedef struct GameSnapshot GameSnapshot;
+
+/* Fixed ring of snapshots. pos is the snapshot shown now; [first, last] is the history that
+   undo and redo can reach. Once the ring is full the oldest snapshots are overwritten, and
+   no operation ever allocates. */
+#define UNDO_CAPACITY 65536
+
+struct UndoRing {
+    GameSnapshot slots[UNDO_CAPACITY];
+    uint64_t first, pos, last;
+};
+typedef struct UndoRing UndoRing;
+
+void clearHistory(UndoRing &ring, const GameSnapshot &snap){
+    ring.first = ring.pos = ring.last = 0;
+    ring.slots[0] = snap;
+}
+
+/* A new roll drops whatever could still be redone */
+void pushHistory(UndoRing &ring, const GameSnapshot &snap){
+    ring.pos++;
+    ring.last = ring.pos;
+    if(ring.pos - ring.first >= UNDO_CAPACITY)
+        ring.first = ring.pos - UNDO_CAPACITY + 1;
+    ring.slots[ring.pos % UNDO_CAPACITY] = snap;
+}
+
+/* Replace the current snapshot, e.g. the fallen block with its respawn */
+void amendHistory(UndoRing &ring, const GameSnapshot &snap){
+    ring.slots[ring.pos % UNDO_CAPACITY] = snap;
+}
+
+const GameSnapshot* undoHistory(UndoRing &ring){
+    if(ring.pos==ring.first)
+        return NULL;
+    return &ring.slots[--ring.pos % UNDO_CAPACITY];
+}
+
+const GameSnapshot* redoHistory(UndoRing &ring){
+    if(ring.pos==ring.last)
+        return NULL;
+    return &ring.slots[++ring.pos % UNDO_CAPACITY];
+}
+
+/**************************
+ * Tweens                 *
+ **************************/
+
+/* A tween drives one float from a to b between two times, holding a until it starts.
+   The pool is a fixed array with the live tweens packed at the front, so a frame only
+   walks those and starting or finishing one never allocates. A value has at most one tween */
+#define MAX_TWEENS 256
+
+enum { EASE_LINEAR=0, EASE_SMOOTH };
+
+struct Tween {
+    float *value;
+    float from, to;
+    double start, length;
+    int ease;
+};
+
+struct TweenPool {
+    Tween slots[MAX_TWEENS];
+    int count;
+};
+
+void stopTween(TweenPool &pool, float *value){
+    for(int i=0;i<pool.count;i++)
+        if(pool.slots[i].value==value){
+            pool.slots[i] = pool.slots[--pool.count];
+            return;
+        }
+}
+
+/* Replaces any tween on value; a full pool just jumps to the end value */
+void startTween(TweenPool &pool, float *value, float from, float to, double start, double length, int ease){
+    stopTween(pool,value);
+    *value = from;
+    if(pool.count==MAX_TWEENS || length<=0){
+        *value = to;
+        return;
     }
-    if(one == 2 ||one == 3  ||one == 4 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point3["seg7"].status=1;
+    Tween &tw = pool.slots[pool.count++];
+    tw.value = value;
+    tw.from = from;
+    tw.to = to;
+    tw.start = start;
+    tw.length = length;
+    tw.ease = ease;
+}
+
+/* Write every live value for time now; finished tweens land exactly on their end value
+   and are swapped out of the pool */
+void updateTweens(TweenPool &pool, double now){
+    for(int i=0;i<pool.count;){
+        Tween &tw = pool.slots[i];
+        double t = (now - tw.start) / tw.length;
+        if(t>=1){
+            *tw.value = tw.to;
+            tw = pool.slots[--pool.count];
+            continue;
+        }
+        if(t<0)
+            t = 0;
+        if(tw.ease==EASE_SMOOTH)
+            t = t*t*(3 - 2*t);
+        *tw.value = tw.from + (tw.to - tw.from)*t;
+        i++;
     }
+}
 
-    poi =poi/10;
-    one =poi%10;
-    if(one == 0 || one == 2 ||one == 3 ||one == 5 ||one == 6 ||one == 7 ||one == 8 ||one == 9){
-    point2["seg1"].status=1;
+/**************************
+ * Replays                *
+ **************************/
+
+/* A replay file is
+       "BLXR" version
+       varint level, varint seed, varint event count
+       per event: varint (frames since the previous event << 3 | event)
+       varint final level, varint final state
+   Events 0-3 are the MOVE_* rolls, 4 and 5 are undo and redo; 6 and 7 are free.
+   Version 1 files have only rolls and still play back.
+   The final level and state let playback check that the rules still agree. */
+#define REPLAY_MAGIC "BLXR"
+#define REPLAY_VERSION 2    // 2: undo and redo events
+#define REPLAY_EVENT_BYTES (1<<20)  // reserved up front, about half a million events
+
+enum { EVENT_UNDO=4, EVENT_REDO=5 };
+
+struct Replay {
+    int level;
+    unsigned long seed;
+    unsigned long count;
+    unsigned long lastFrame;
+    vector<unsigned char> events;
+    bool full;                  // stopped at REPLAY_EVENT_BYTES, the final state is from then
+    int finalLevel;
+    unsigned int finalState;
+};
+typedef struct Replay Replay;
+
+Replay recording;
+
+void putVarint(vector<unsigned char> &out, uint64_t v){
+    while(v >= 0x80){
+        out.push_back((unsigned char)(v | 0x80));
+        v >>= 7;
     }
-    if(one == 0 || one == 1 ||one == 2 ||one == 3 ||one == 4 ||one == 7 ||one == 8 ||one == 9){
-    point2["seg2"].status=1;
+    out.push_back((unsigned char)v);
+}
+
+bool getVarint(const unsigned char *&p, const unsigned char *end, uint64_t &v){
+    v = 0;
+    for(int shift=0;p<end && shift<64;shift+=7){
+        unsigned char byte = *p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
     }
-    if(one == 0 || one == 1 ||one == 3 ||one == 4 ||one == 5  ||one == 6 ||one == 7 ||one == 8 ||one == 9){
-    point2["seg3"].status=1;
+    return false;
+}
+
+/* The session seed identifies the run; the rules themselves are deterministic */
+void startRecording(){
+    recording.level = level;
+    recording.seed = (unsigned long)time(NULL);
+    recording.count = 0;
+    recording.lastFrame = frameCount;
+    recording.full = false;
+    recording.events.clear();
+    recording.events.reserve(REPLAY_EVENT_BYTES);
+}
+
+/* The events never grow past what was reserved, so recording doesn't allocate in the frame
+   loop. A longer session keeps a replay of its start, which still checks out on playback */
+void recordEvent(int event){
+    if(recording.full)
+        return;
+    if(recording.events.size() + 10 > recording.events.capacity()){
+        recording.full = true;
+        recording.finalLevel = level;
+        recording.finalState = blockState;
+        fprintf(stderr, "replay: full after %lu events, the rest of the session is not recorded\n", recording.count);
+        return;
     }
-    if(one == 0 || one == 2 ||one == 3 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point2["seg4"].status=1;
+    putVarint(recording.events, ((uint64_t)(frameCount - recording.lastFrame) << 3) | event);
+    recording.lastFrame = frameCount;
+    recording.count++;
+}
+
+bool saveReplay(const Replay &r, const char *path){
+    vector<unsigned char> out(REPLAY_MAGIC, REPLAY_MAGIC+4);
+    out.push_back(REPLAY_VERSION);
+    putVarint(out, r.level);
+    putVarint(out, r.seed);
+    putVarint(out, r.count);
+    out.insert(out.end(), r.events.begin(), r.events.end());
+    putVarint(out, r.finalLevel);
+    putVarint(out, r.finalState);
+
+    FILE *f = fopen(path, "wb");
+    if(!f)
+        return false;
+    bool ok = fwrite(&out[0], 1, out.size(), f)==out.size();
+    return fclose(f)==0 && ok;
+}
+
+bool loadReplay(Replay &r, const char *path){
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    vector<unsigned char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if(data.size()<5 || memcmp(&data[0], REPLAY_MAGIC, 4)!=0 || data[4]<1 || data[4]>REPLAY_VERSION)
+        return false;
+
+    const unsigned char *p = &data[5], *end = &data[0] + data.size();
+    uint64_t level, seed, count, v;
+    if(!getVarint(p,end,level) || !getVarint(p,end,seed) || !getVarint(p,end,count))
+        return false;
+    r.level = level;
+    r.seed = seed;
+    r.count = count;
+    r.full = false;
+    const unsigned char *events = p;
+    for(uint64_t i=0;i<count;i++)
+        if(!getVarint(p,end,v))
+            return false;
+    r.events.assign(events, p);
+    if(!getVarint(p,end,level) || !getVarint(p,end,v))
+        return false;
+    r.finalLevel = level;
+    r.finalState = v;
+    return true;
+}
+
+/* Write the session so far to replays/session_<seed>.blxr, or session_<seed>_<n>.blxr when
+   another session started in the same second already has that name */
+void saveSessionReplay(){
+    if(headless || recording.count==0)
+        return;
+    if(!recording.full){
+        recording.finalLevel = level;
+        recording.finalState = blockState;
     }
-    if(one == 0 || one == 2 ||one == 6 ||one == 8){
-    point2["seg5"].status=1;
+    static char path[64];   // claimed once, later saves of the session overwrite it
+    mkdir("replays", 0755);
+    for(int n=0;!path[0];n++){
+        if(n==0)
+            snprintf(path, sizeof(path), "replays/session_%lu.blxr", recording.seed);
+        else
+            snprintf(path, sizeof(path), "replays/session_%lu_%d.blxr", recording.seed, n);
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd>=0)
+            close(fd);
+        else if(errno==EEXIST)
+            path[0] = 0;
+        else{
+            fprintf(stderr, "%s: cannot write replay\n", path);
+            path[0] = 0;
+            return;
+        }
     }
-    if(one == 0 || one == 4 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point2["seg6"].status=1;
+    if(!saveReplay(recording, path))
+        fprintf(stderr, "%s: cannot write replay\n", path);
+}
+
+/* Re-run a replay through the transition tables, as fast as possible. A fall, a fragile
+   break or the hole takes effect before the next event, like the respawn in draw();
+   undo and redo walk the same kind of history ring as the game. */
+bool playReplay(const Replay &r, int &finalLevel, unsigned int &finalState){
+    static UndoRing ring;
+    int lvl = r.level;
+    unsigned int state = makeState(levels[lvl], levels[lvl].start, STANDING, 0);
+    unsigned int rolls = 0;
+    int pending = STEP_OK;
+    const unsigned char *p = r.events.empty() ? NULL : &r.events[0];
+    const unsigned char *end = p + r.events.size();
+    GameSnapshot snap = { state, 0, -1, (unsigned char)lvl };
+    clearHistory(ring, snap);
+
+    for(unsigned long i=0;i<r.count;i++){
+        uint64_t v;
+        int event;
+        if(!getVarint(p,end,v) || (event = v & 7) > EVENT_REDO)
+            return false;
+        if(pending!=STEP_OK){
+            state = makeState(levels[pending==STEP_GOAL ? 1 : lvl], levels[pending==STEP_GOAL ? 1 : lvl].start, STANDING, 0);
+            GameSnapshot respawn = { state, rolls, -1, (unsigned char)(pending==STEP_GOAL ? 1 : lvl) };
+            if(pending==STEP_GOAL && lvl==0)
+                clearHistory(ring, respawn);
+            else
+                amendHistory(ring, respawn);
+            lvl = respawn.level;
+            pending = STEP_OK;
+        }
+        if(event==EVENT_UNDO || event==EVENT_REDO){
+            const GameSnapshot *s = (event==EVENT_UNDO) ? undoHistory(ring) : redoHistory(ring);
+            if(s){
+                lvl = s->level;
+                state = s->state;
+                rolls = s->moves;
+            }
+            continue;
+        }
+        Transition t = levels[lvl].table[(size_t)state*4 + event];
+        state = t.next;
+        pending = t.outcome;
+        rolls++;
+        GameSnapshot after = { state, rolls, -1, (unsigned char)lvl };
+        pushHistory(ring, after);
     }
-    if(one == 2 || one == 3 ||one == 4 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point2["seg7"].status=1;
+    finalLevel = lvl;
+    finalState = state;
+    return true;
+}
+
+/**************************
+ * Progress store         *
+ **************************/
+
+/* Best moves and time, completions and falls per level, kept across runs in progress/:
+
+       progress.dat   checkpoint: ProgressHeader, a ProgressStats per level, then a CRC-32
+       progress.log   ProgressRecords appended since that checkpoint
+
+   The frame loop only puts records into a ring. A writer thread appends them to the log
+   once a second in one write, without fsync, and after PROGRESS_COMPACT of them writes a
+   checkpoint to a temporary file, syncs it, renames it over the old one and empties the
+   log. Records are numbered and a checkpoint holds the last number it includes, so a
+   crash before the log is emptied counts nothing twice; a record torn or lost by a power
+   cut fails its CRC and it and the rest of the log are dropped. */
+#define PROGRESS_DIR "progress"
+#define PROGRESS_MAGIC "BLXS"
+#define PROGRESS_VERSION 1
+#define PROGRESS_LEVELS 2
+#define PROGRESS_RING 256       // records queued by the frame loop, more are dropped
+#define PROGRESS_COMPACT 512    // log records between checkpoints
+#define PROGRESS_FLUSH 1.0      // seconds between appends to the log
+
+enum { PROGRESS_COMPLETE=1, PROGRESS_FALL };
+
+struct ProgressRecord {
+    uint64_t seq;
+    uint32_t kind;              // PROGRESS_*
+    int32_t level;
+    int32_t moves, seconds;
+    uint32_t reserved;
+    uint32_t crc;               // of the bytes before it
+};
+typedef struct ProgressRecord ProgressRecord;
+
+struct ProgressStats {
+    int32_t bestMoves, bestSeconds;     // -1 until the level is completed
+    uint32_t completions, falls;
+};
+typedef struct ProgressStats ProgressStats;
+
+struct ProgressHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t seq;               // last record folded into the stats
+    uint32_t levels;
+    uint32_t reserved;
+};
+typedef struct ProgressHeader ProgressHeader;
+
+struct ProgressStore {
+    int log = -1;               // file descriptor, -1 when the store is closed
+    ProgressStats stats[PROGRESS_LEVELS];   // owned by the writer thread once it runs
+    uint64_t seq;
+    int logRecords;
+    ProgressRecord ring[PROGRESS_RING];     // single producer: the frame loop
+    atomic<uint32_t> head, tail;
+    uint64_t nextSeq;                       // frame loop side
+    atomic<unsigned long> dropped;
+    atomic<bool> stop;
+    thread writer;
+    ~ProgressStore(){ if(writer.joinable()){ stop = true; writer.join(); } }   // exit() still checkpoints
+};
+typedef struct ProgressStore ProgressStore;
+
+ProgressStore progress;
+
+uint32_t crc32(const void *data, size_t n){
+    static uint32_t table[256];
+    static once_flag built;
+    call_once(built, []{
+        for(uint32_t i=0;i<256;i++){
+            uint32_t c = i;
+            for(int k=0;k<8;k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+    uint32_t c = 0xffffffffu;
+    for(size_t i=0;i<n;i++)
+        c = table[(c ^ ((const unsigned char*)data)[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+static void resetStats(ProgressStats *stats){
+    for(int l=0;l<PROGRESS_LEVELS;l++){
+        stats[l].bestMoves = stats[l].bestSeconds = -1;
+        stats[l].completions = stats[l].falls = 0;
     }
+}
 
+static void applyRecord(ProgressStats *stats, const ProgressRecord &r){
+    ProgressStats &s = stats[r.level];
+    if(r.kind==PROGRESS_FALL){
+        s.falls++;
+        return;
+    }
+    s.completions++;
+    if(s.bestMoves<0 || r.moves<s.bestMoves)
+        s.bestMoves = r.moves;
+    if(s.bestSeconds<0 || r.seconds<s.bestSeconds)
+        s.bestSeconds = r.seconds;
+}
+
+static bool goodRecord(const ProgressRecord &r){
+    return r.crc==crc32(&r, offsetof(ProgressRecord, crc)) && (r.kind==PROGRESS_COMPLETE || r.kind==PROGRESS_FALL) &&
+           r.level>=0 && r.level<PROGRESS_LEVELS;
+}
+
+/* Load the checkpoint and the valid part of the log after it into stats and seq. With
+   'repair' the log is cut back to its valid records so appends don't land after junk */
+bool readProgress(int log, ProgressStats *stats, uint64_t &seq, bool repair){
+    resetStats(stats);
+    seq = 0;
+    FILE *f = fopen(PROGRESS_DIR "/progress.dat", "rb");
+    if(f){
+        unsigned char buf[sizeof(ProgressHeader) + PROGRESS_LEVELS*sizeof(ProgressStats) + sizeof(uint32_t)];
+        ProgressHeader head;
+        uint32_t crc;
+        bool ok = fread(buf, 1, sizeof buf, f)==sizeof buf && fgetc(f)==EOF;
+        fclose(f);
+        memcpy(&head, buf, sizeof head);
+        memcpy(&crc, buf + sizeof buf - sizeof crc, sizeof crc);
+        ok = ok && memcmp(head.magic, PROGRESS_MAGIC, 4)==0 && head.version==PROGRESS_VERSION &&
+             head.levels==PROGRESS_LEVELS && crc==crc32(buf, sizeof buf - sizeof crc);
+        if(!ok){
+            fprintf(stderr, PROGRESS_DIR "/progress.dat: damaged, starting from the log alone\n");
+            resetStats(stats);
+        }
+        else{
+            memcpy(stats, buf + sizeof head, PROGRESS_LEVELS*sizeof(ProgressStats));
+            seq = head.seq;
+        }
+    }
 
-    poi =poi/10;
-    one =poi%10;
-    if(one == 0 || one == 2 ||one == 3 ||one == 5 ||one == 6 ||one == 7 ||one == 8 ||one == 9){
-    point1["seg1"].status=1;
+    ProgressRecord r;
+    off_t valid = 0;
+    lseek(log, 0, SEEK_SET);
+    while(read(log, &r, sizeof r)==(ssize_t)sizeof r && goodRecord(r)){
+        if(r.seq>seq){
+            applyRecord(stats, r);
+            seq = r.seq;
+        }
+        valid += sizeof r;
     }
-    if(one == 0 || one == 1 ||one == 2 ||one == 3 ||one == 4 ||one == 7 ||one == 8 ||one == 9){
-    point1["seg2"].status=1;
+    if(repair && lseek(log, 0, SEEK_END)!=valid){
+        fprintf(stderr, PROGRESS_DIR "/progress.log: dropping a damaged tail after %ld records\n", (long)(valid/sizeof r));
+        if(ftruncate(log, valid)<0)
+            return false;
     }
-    if(one == 0 || one == 1 ||one == 3 ||one == 4 ||one == 5  ||one == 6 ||one == 7 ||one == 8 ||one == 9){
-    point1["seg3"].status=1;
+    return true;
+}
+
+/* Write the stats to a new checkpoint, then empty the log it replaces */
+static bool checkpointProgress(ProgressStore &ps){
+    unsigned char buf[sizeof(ProgressHeader) + PROGRESS_LEVELS*sizeof(ProgressStats) + sizeof(uint32_t)];
+    ProgressHeader head = {};
+    memcpy(head.magic, PROGRESS_MAGIC, 4);
+    head.version = PROGRESS_VERSION;
+    head.seq = ps.seq;
+    head.levels = PROGRESS_LEVELS;
+    memcpy(buf, &head, sizeof head);
+    memcpy(buf + sizeof head, ps.stats, PROGRESS_LEVELS*sizeof(ProgressStats));
+    uint32_t crc = crc32(buf, sizeof buf - sizeof crc);
+    memcpy(buf + sizeof buf - sizeof crc, &crc, sizeof crc);
+
+    int fd = open(PROGRESS_DIR "/progress.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd<0)
+        return false;
+    bool ok = write(fd, buf, sizeof buf)==(ssize_t)sizeof buf && fsync(fd)==0;
+    ok = (close(fd)==0) && ok;
+    ok = ok && rename(PROGRESS_DIR "/progress.tmp", PROGRESS_DIR "/progress.dat")==0;
+    int dir = open(PROGRESS_DIR, O_RDONLY);
+    if(dir>=0){
+        fsync(dir);             // the rename itself
+        close(dir);
     }
-    if(one == 0 || one == 2 ||one == 3 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point1["seg4"].status=1;
+    if(!ok){
+        fprintf(stderr, PROGRESS_DIR "/progress.dat: cannot write checkpoint\n");
+        return false;
     }
-    if(one == 0 || one == 2 ||one == 6 ||one == 8){
-    point1["seg5"].status=1;
+    ps.logRecords = 0;
+    return ftruncate(ps.log, 0)==0;
+}
+
+/* Move what the frame loop queued into the stats and the end of the log */
+static void flushProgress(ProgressStore &ps){
+    ProgressRecord batch[PROGRESS_RING];
+    uint32_t tail = ps.tail.load(memory_order_relaxed), head = ps.head.load(memory_order_acquire);
+    int n = 0;
+    for(;tail!=head;tail++){
+        ProgressRecord &r = batch[n++];
+        r = ps.ring[tail % PROGRESS_RING];
+        r.crc = crc32(&r, offsetof(ProgressRecord, crc));
+        applyRecord(ps.stats, r);
+        ps.seq = r.seq;
     }
-    if(one == 0 || one == 4 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point1["seg6"].status=1;
+    ps.tail.store(tail, memory_order_release);
+    if(n==0)
+        return;
+    if(write(ps.log, batch, n*sizeof(ProgressRecord))!=(ssize_t)(n*sizeof(ProgressRecord)))
+        fprintf(stderr, PROGRESS_DIR "/progress.log: append failed\n");
+    ps.logRecords += n;
+    if(ps.logRecords>=PROGRESS_COMPACT)
+        checkpointProgress(ps);
+}
+
+static void progressWriter(){
+    double last = wallClock();
+    while(!progress.stop){
+        this_thread::sleep_for(chrono::milliseconds(50));
+        if(wallClock()-last>=PROGRESS_FLUSH){
+            flushProgress(progress);
+            last = wallClock();
+        }
     }
-    if(one == 2 || one == 3 ||one == 4 ||one == 5 ||one == 6 ||one == 8 ||one == 9){
-    point1["seg7"].status=1;
+    flushProgress(progress);
+    checkpointProgress(progress);
+}
+
+void printProgress(const ProgressStats *stats){
+    for(int l=0;l<PROGRESS_LEVELS;l++){
+        const ProgressStats &s = stats[l];
+        if(s.completions)
+            printf("level %d: best %d moves, best time %d:%02d, %u completions, %u falls\n",
+                   l, s.bestMoves, s.bestSeconds/60, s.bestSeconds%60, s.completions, s.falls);
+        else
+            printf("level %d: not completed yet, %u falls\n", l, s.falls);
     }
+}
 
+/* Open the store and start its writer; the game runs on without one if this fails */
+bool openProgress(){
+    mkdir(PROGRESS_DIR, 0755);
+    int log = open(PROGRESS_DIR "/progress.log", O_RDWR | O_CREAT | O_APPEND, 0644);
+    if(log<0){
+        fprintf(stderr, PROGRESS_DIR "/progress.log: cannot open, progress is not saved\n");
+        return false;
+    }
+    if(!readProgress(log, progress.stats, progress.seq, true)){
+        close(log);
+        return false;
+    }
+    struct stat st;
+    fstat(log, &st);
+    progress.log = log;
+    progress.logRecords = st.st_size/sizeof(ProgressRecord);
+    progress.nextSeq = progress.seq+1;
+    progress.head = progress.tail = 0;
+    progress.dropped = 0;
+    progress.stop = false;
+    printProgress(progress.stats);
+    progress.writer = thread(progressWriter);
+    return true;
+}
 
-    for(map<string,Sprite>::iterator it1=point1.begin();it1!=point1.end();it1++){
-        string current = it1->first; 
+/* Frame loop side: queue a record, or count it dropped if the writer is behind. Never
+   blocks and never allocates */
+void noteProgress(int kind, int lvl, int moves, int seconds){
+    if(progress.log<0)
+        return;
+    uint32_t head = progress.head.load(memory_order_relaxed);
+    if(head - progress.tail.load(memory_order_acquire) == PROGRESS_RING){
+        progress.dropped++;
+        return;
+    }
+    ProgressRecord &r = progress.ring[head % PROGRESS_RING];
+    r.seq = progress.nextSeq++;
+    r.kind = kind;
+    r.level = lvl;
+    r.moves = moves;
+    r.seconds = seconds;
+    r.reserved = 0;
+    progress.head.store(head+1, memory_order_release);
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+/* Flush, checkpoint and stop the writer */
+void closeProgress(){
+    if(progress.log<0)
+        return;
+    progress.stop = true;
+    progress.writer.join();
+    close(progress.log);
+    progress.log = -1;
+    if(progress.dropped)
+        fprintf(stderr, "progress: %lu records dropped, the writer fell behind\n", (unsigned long)progress.dropped);
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
+/* Block, tile and bridge animations, set once per frame by the main loop */
+#define ROLL_TIME 0.15
+#define FALL_SPEED 180.0
+#define FALL_DEPTH 260.0
+#define TILE_FALL_SPEED 300.0
+#define TILE_DROP 600.0
+#define BRIDGE_TIME 0.3
+
+struct RollAnimation {
+    int active;
+    float t;
+    glm::mat4 from;
+    glm::vec3 pivot, axis;
+    float angle;
+};
 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+double frameTime = 0;
+TweenPool tweens;
+RollAnimation roll;
+vector<int> bridges[2];     // tiles[level] indices of the tiles a gate bit moves
+unsigned int bridgeBits[2];
+
+/* Fold each bridge whose gate changed towards its new position and drop each crumbling
+   tile whose gate was set, after the roll lands */
+void syncBridges(unsigned int bits){
+    unsigned int changed = bits ^ bridgeBits[level];
+    if(!changed)
+        return;
+    double start = roll.active ? frameTime + ROLL_TIME : frameTime;
+    TileStore &ts = tiles[level];
+    for(size_t k=0;k<bridges[level].size();k++){
+        int i = bridges[level][k];
+        if(!((changed >> ts.gate[i]) & 1))
+            continue;
+        int set = (bits >> ts.gate[i]) & 1;
+        if(ts.hinge[i]==0){
+            float to = set ? TILE_DROP : 0;
+            startTween(tweens, &ts.drop[i], ts.drop[i], to, start, fabs(to-ts.drop[i])/TILE_FALL_SPEED, EASE_LINEAR);
+        }
+        else
+            startTween(tweens, &ts.tilt[i], ts.tilt[i], set ? 0 : ts.hinge[i]*90.0, start, BRIDGE_TIME, EASE_SMOOTH);
+    }
+    bridgeBits[level] = bits;
+}
 
-        if(point1[current].status==0)
-        continue;
+/* Drop distance of the moving tile on a cell of the current level, NULL when there is none */
+float* tileDrop(int cell){
+    int i = tileOfCell[level].empty() ? -1 : tileOfCell[level][cell];
+    return (i>=0) ? &tiles[level].drop[i] : NULL;
+}
 
-        Matrices.model = glm::mat4(1.0f);
+/* Drop the block, and the tile under it when it broke one, once the roll has landed */
+void startFall(){
+    double start = frameTime + ROLL_TIME;
+    flag =1;
+    startTween(tweens, &downfall, 0, FALL_DEPTH, start, FALL_DEPTH/FALL_SPEED, EASE_LINEAR);
+    float *drop = tileflag ? tileDrop(tileCell) : NULL;
+    if(drop)
+        startTween(tweens, drop, 0, TILE_DROP, start, TILE_DROP/TILE_FALL_SPEED, EASE_LINEAR);
+}
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(point1[current].x,point1[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(point1[current].object);
+/* Put the block and any fallen tile back after a fall or a jump in history */
+void clearFall(){
+    float *drop = tileflag ? tileDrop(tileCell) : NULL;
+    if(drop){
+        stopTween(tweens, drop);
+        *drop = 0;
     }
+    stopTween(tweens, &downfall);
+    downfall =0;
+    flag =0;
+    tileflag =0;
+}
 
-    for(map<string,Sprite>::iterator it1=point2.begin();it1!=point2.end();it1++){
-        string current = it1->first; 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+/* Move the block sprite and the bridges to match blockState */
+void placeBlock(){
+    Level &lv = levels[level];
+    int cell = stateCell(lv,blockState);
+    int orientation = stateOrientation(lv,blockState);
+    unsigned int bits = stateGates(lv,blockState);
+
+    blocks.centre[0].x = lv.x0 + (cell % lv.cols)*TILE_SIZE + (orientation==LYING_X ? TILE_SIZE/2 : 0);
+    blocks.centre[0].z = lv.z0 + (cell / lv.cols)*TILE_SIZE + (orientation==LYING_Z ? TILE_SIZE/2 : 0);
+    blocks.centre[0].y = (orientation==STANDING) ? 60.0 : 30.0;
+    blocks.direction[0] = orientation;
+    syncBridges(bits);
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+void resetBlock(){
+    blockState = makeState(levels[level],levels[level].start,STANDING,0);
+    placeBlock();
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+UndoRing history;
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
 
-        if(point2[current].status==0)
-        continue;
-        Matrices.model = glm::mat4(1.0f);
+GameSnapshot currentSnapshot(){
+    GameSnapshot snap = { blockState, (unsigned int)moves, tileflag ? tileCell : -1, (unsigned char)level };
+    return snap;
+}
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(point2[current].x,point2[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(point2[current].object);
+/* Model matrix of the block at rest in its current state: turned onto its side when lying,
+   then moved from where it was created to its cell */
+void settleBlock(){
+    glm::vec3 rest = blocks.pos[0];
+    glm::vec3 centre (blocks.centre[0].x, blocks.centre[0].y, blocks.centre[0].z);
+    glm::mat4 turn = glm::mat4(1.0f);
+    if(blocks.direction[0]==LYING_X)
+        turn = glm::rotate((float)(M_PI/2), glm::vec3(0,0,1));
+    else if(blocks.direction[0]==LYING_Z)
+        turn = glm::rotate((float)(M_PI/2), glm::vec3(1,0,0));
+    rotateblock = glm::translate(centre) * turn * glm::translate(-rest);
+}
+
+void restoreSnapshot(const GameSnapshot &snap){
+    stopTween(tweens, &roll.t);
+    roll.active = 0;
+    clearFall();
+    level = snap.level;
+    blockState = snap.state;
+    moves = snap.moves;
+    placeBlock();
+    settleBlock();
+    if(snap.broken>=0){
+        tileflag =1;
+        tileCell = snap.broken;
+        float *drop = tileDrop(tileCell);
+        if(drop)
+            *drop = TILE_DROP;
+    }
+}
+
+void undoMove(){
+    recordEvent(EVENT_UNDO);
+    const GameSnapshot *snap = undoHistory(history);
+    if(snap)
+        restoreSnapshot(*snap);
+}
+
+void redoMove(){
+    recordEvent(EVENT_REDO);
+    const GameSnapshot *snap = redoHistory(history);
+    if(snap)
+        restoreSnapshot(*snap);
+}
+
+/* Apply one roll through the level's transition table */
+void stepBlock(int move){
+    recordEvent(move);
+    Transition t = levels[level].table[(size_t)blockState*4 + move];
+    blockState = t.next;
+    placeBlock();
+
+    switch(t.outcome){
+        case STEP_FALL:
+            noteProgress(PROGRESS_FALL, level, moves, seconds);
+            startFall();
+            break;
+        case STEP_BREAK:
+            noteProgress(PROGRESS_FALL, level, moves, seconds);
+            tileflag =1;
+            tileCell = stateCell(levels[level], blockState);
+            startFall();
+            break;
+        case STEP_GOAL:
+            noteProgress(PROGRESS_COMPLETE, level, moves, seconds);
+            startFall();
+            if(level==0)
+                sig =1;
+            else{
+                moves=0;
+                seconds=0;
+            }
+            break;
+        default:
+            break;
+    }
+    pushHistory(history, currentSnapshot());
+}
+
+/* Start turning the block 90 degrees about the edge it rolls over and apply the roll.
+   The game state changes at once; only the picture lags behind by ROLL_TIME */
+void rollBlock(int move){
+    float x = blocks.centre[0].x;
+    float z = blocks.centre[0].z;
+    int direction = blocks.direction[0];
+
+    settleBlock();
+    roll.from = rotateblock;
+    if(move==MOVE_UP || move==MOVE_DOWN){
+        float sign = (move==MOVE_UP) ? -1 : 1;
+        roll.pivot = glm::vec3(0, 0, z + sign*(direction==LYING_Z ? 60.0 : 30.0));
+        roll.axis = glm::vec3(1,0,0);
+        roll.angle = sign*M_PI/2;
     }
+    else{
+        float sign = (move==MOVE_RIGHT) ? 1 : -1;
+        roll.pivot = glm::vec3(x + sign*(direction==LYING_X ? 60.0 : 30.0), 0, 0);
+        roll.axis = glm::vec3(0,0,1);
+        roll.angle = -sign*M_PI/2;
+    }
+    roll.active = 1;
+    startTween(tweens, &roll.t, 0, 1, frameTime, ROLL_TIME, EASE_LINEAR);
+    stepBlock(move);
+}
 
-    for(map<string,Sprite>::iterator it1=point3.begin();it1!=point3.end();it1++){
-        string current = it1->first; 
-        glm::mat4 MVP;  // MVP = Projection * View * Model
+int blockIdle(){
+    return flag==0 && !roll.active;
+}
 
-        glm::vec3 eye ( 0 ,0, 5 );
-        glm::vec3 target (0,0, 0);
-        glm::vec3 up (0, 1, 0);
-        Matrices1.view = glm::lookAt(eye, target, up);
+/* Pose the block from the tweens. A roll is the resting pose of the old state turned about
+   the pivot edge by angle*t; nothing carries over between frames */
+void animateBlock(){
+    if(roll.active){
+        if(roll.t < 1){
+            rotateblock = glm::translate(roll.pivot) * glm::rotate((float)(roll.angle*roll.t), roll.axis) * glm::translate(-roll.pivot) * roll.from;
+            return;
+        }
+        roll.active = 0;
+        settleBlock();
+    }
+    if(flag==1)
+        blocks.centre[0].y = (blocks.direction[0]==STANDING ? 60.0 : 30.0) - downfall;
+}
 
-        Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
 
-        glm::mat4 VP = Matrices1.projection * Matrices1.view;
+void draw (GLFWwindow* window, int width, int height)
+{
 
-        if(point3[current].status==0)
-        continue;
-        Matrices.model = glm::mat4(1.0f);
+    if(gameover ==1)
+        return;
 
-        /* Render your scene */
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(point3[current].x,point3[current].y, 0.0f)); // glTranslatef
-        ObjectTransform=translateObject;
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
+    if(key_pressed_T == 1){
+        eye_x = blocks.centre[0].x;
+        eye_y = 1300;
+        eye_z = blocks.centre[0].z;
+        target_x = blocks.centre[0].x;
+        target_y = 0;
+        target_z = blocks.centre[0].z - 10;
+    }
+    else if(key_pressed_F ==1){
+        eye_x = blocks.centre[0].x ;
+        eye_y = blocks.centre[0].y +300;
+        eye_z = blocks.centre[0].z +300;
+        target_x = blocks.centre[0].x;
+        target_y = blocks.centre[0].y;
+        target_z = blocks.centre[0].z;
+    }
+    else if(key_pressed_B ==1){
+        eye_x = blocks.centre[0].x;
+        eye_y = blocks.centre[0].y + 300; 
+        eye_z = blocks.centre[0].z + 50;
+        target_x = blocks.centre[0].x;
+        target_y = blocks.centre[0].y;
+        target_z = blocks.centre[0].z - 200;   
+    }
+
+
+    glClearColor(1.0f,1.0f,1.0f,1.0f);//set background color
+    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glUseProgram (programID);
+      
+    int fbwidth=width, fbheight=height; 
+    glm::vec3 eye ( eye_x ,eye_y, eye_z );
+    glm::vec3 target (target_x,target_y, target_z);
+    glm::vec3 up (0, 1, 0);
+    Matrices.view = glm::lookAt(eye, target, up);
+
+
+    /* HUD: each segment lights when its bit is set in its display's digit */
+    int digits[HUD_DIGITS];
+    int poi = abs(moves), time = abs(seconds % 60), time1 = abs(seconds/60);
+    digits[HUD_POINT1] = poi/100%10;
+    digits[HUD_POINT2] = poi/10%10;
+    digits[HUD_POINT3] = poi%10;
+    digits[HUD_SEC1] = time%10;
+    digits[HUD_SEC2] = time/10;
+    digits[HUD_MIN1] = time1%10;
+    digits[HUD_MIN2] = time1/10%10;
+
+    Matrices1.view = glm::lookAt(glm::vec3(0,0,5), glm::vec3(0,0,0), glm::vec3(0,1,0));
+    Matrices1.projection = glm::ortho((float)(-400.0f), (float)(400.0f), (float)(-300.0f), (float)(300.0f), 0.1f, 500.0f);
+    glm::mat4 hudVP = Matrices1.projection * Matrices1.view;
+
+    for(size_t i=0;i<hud.mesh.size();i++){
+        if(hud.digit[i]>=0 && !((sevenSegment[digits[hud.digit[i]]] >> hud.segment[i]) & 1))
+            continue;
+        glm::mat4 MVP = hudVP * glm::translate (hud.pos[i]); // MVP = p * V * M
         glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(point3[current].object);
+        draw3DObject(hud.mesh[i]);
     }
 
     GLfloat fov = M_PI/4;
@@ -1276,432 +3998,115 @@ void draw (GLFWwindow* window, int width, int height)
     if(mouse_clicked==1) {
         double mouse_x_cur;
         double mouse_y_cur;
-        glfwGetCursorPos(window,&mouse_x_cur,&mouse_y_cur);
-    }
-
-    if(key_pressed_up ==1 && flag ==0){
-        if(block["block"].direction ==0){
-             glm::mat4 translateObject = glm::translate (glm::vec3(0,0,-(block["block"].z_change - 30)));
-             glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(1,0,0));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(0,0,block["block"].z_change -30));
-
-             rotateblock = translateObject1*rotate*translateObject*rotateblock;
-             block["block"].x_change += 0;
-             block["block"].z_change -= 90.0;
-             block["block"].y_change -= 30.0;
-             block["block"].direction =2;
-        }
-        else if(block["block"].direction==1){
-             glm::mat4 translateObject = glm::translate (glm::vec3(0,0,-(block["block"].z_change - 30)));
-             glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(1,0,0));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(0,0,block["block"].z_change -30));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].z_change -= 60.0;
-        } 
-        else if(block["block"].direction==2){
-             glm::mat4 translateObject = glm::translate (glm::vec3(0,0,-(block["block"].z_change - 60)));
-             glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(1,0,0));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(0,0,block["block"].z_change -60));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].y_change += 30.0;
-             block["block"].z_change -= 90.0;
-             block["block"].direction =0;
-        }
-        if(switches["switch1"].x == block["block"].x_change && switches["switch1"].z == block["block"].z_change){
-            if(switch1==1)
-                switch1=0;
-            else
-                switch1 =1;
-        }
-        if(switches["switch3"].x == block["block"].x_change && switches["switch3"].z == block["block"].z_change){
-            if(switch2==1)
-                switch2=0;
-            else 
-                switch2 =1;
-        }
-        key_pressed_up =0;
+        glfwGetCursorPos(window,&mouse_x_cur,&mouse_y_cur);
     }
 
-    if(key_pressed_down ==1 && flag ==0){
-        if(block["block"].direction ==0){
-             glm::mat4 translateObject = glm::translate (glm::vec3(0,0,-(block["block"].z_change + 30)));
-             glm::mat4 rotate = glm::rotate((float)((90.0)*M_PI/180.0f), glm::vec3(1,0,0));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(0,0,block["block"].z_change +30));
-
-             rotateblock = translateObject1*rotate*translateObject*rotateblock;
-             block["block"].x_change += 0;
-             block["block"].z_change += 90.0;
-             block["block"].y_change -= 30.0;
-             block["block"].direction =2;
-        }
-        else if(block["block"].direction==1){
-             glm::mat4 translateObject = glm::translate (glm::vec3(0,0,-(block["block"].z_change + 30)));
-             glm::mat4 rotate = glm::rotate((float)((90.0)*M_PI/180.0f), glm::vec3(1,0,0));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(0,0,block["block"].z_change +30));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].z_change += 60.0;
-        } 
-        else if(block["block"].direction==2){
-             glm::mat4 translateObject = glm::translate (glm::vec3(0,0,-(block["block"].z_change + 60)));
-             glm::mat4 rotate = glm::rotate((float)((+90.0)*M_PI/180.0f), glm::vec3(1,0,0));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(0,0,block["block"].z_change +60));
+    if(key_pressed_up ==1 && blockIdle()){
+        rollBlock(MOVE_UP);
+        key_pressed_up =0;
+    }
 
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].y_change += 30.0;
-             block["block"].z_change += 90.0;
-             block["block"].direction =0;
-        }
-     key_pressed_down =0;       
+    if(key_pressed_down ==1 && blockIdle()){
+        rollBlock(MOVE_DOWN);
+        key_pressed_down =0;
     }
-    
-    if(key_pressed_right ==1 && flag==0){
-        if(block["block"].direction ==0){
-             glm::mat4 translateObject = glm::translate (glm::vec3(-(block["block"].x_change + 30.0),0,0));
-             glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(block["block"].x_change + 30.0,0,0));
-
-             rotateblock = translateObject1*rotate*translateObject*rotateblock;
-             block["block"].x_change += 90.0;
-             block["block"].y_change -= 30.0;
-             block["block"].direction =1;
-        }
-        else if(block["block"].direction==1){
-             glm::mat4 translateObject = glm::translate (glm::vec3(-(block["block"].x_change + 60),0,0));
-             glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(block["block"].x_change + 60,0,0));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].x_change += 90.0;
-             block["block"].y_change += 30.0;
-             block["block"].direction = 0;
-        } 
-        else if(block["block"].direction==2){
-             glm::mat4 translateObject = glm::translate (glm::vec3(-(block["block"].x_change + 30.0),0,0));
-             glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(block["block"].x_change + 30.0,0,0));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].x_change += 60.0;
-             block["block"].direction = 2;
-        }
+
+    if(key_pressed_right ==1 && blockIdle()){
+        rollBlock(MOVE_RIGHT);
         key_pressed_right =0;
     }
 
-    if(key_pressed_left ==1 && flag==0){
-        if(block["block"].direction ==0){
-             glm::mat4 translateObject = glm::translate (glm::vec3(-(block["block"].x_change - 30.0),0,0));
-             glm::mat4 rotate = glm::rotate((float)((90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(block["block"].x_change - 30.0,0,0));
-
-             rotateblock = translateObject1*rotate*translateObject*rotateblock;
-             block["block"].x_change -= 90.0;
-             block["block"].y_change -= 30.0;
-             block["block"].direction =1;
-        }
-        else if(block["block"].direction==1){
-             glm::mat4 translateObject = glm::translate (glm::vec3(-(block["block"].x_change - 60),0,0));
-             glm::mat4 rotate = glm::rotate((float)((90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(block["block"].x_change - 60,0,0));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].x_change -= 90.0;
-             block["block"].y_change += 30.0;
-             block["block"].direction = 0;
-        } 
-        else if(block["block"].direction==2){
-             glm::mat4 translateObject = glm::translate (glm::vec3(-(block["block"].x_change - 30.0),0,0));
-             glm::mat4 rotate = glm::rotate((float)((90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-             glm::mat4 translateObject1 = glm::translate (glm::vec3(block["block"].x_change - 30.0,0,0));
-
-             rotateblock = translateObject1 * rotate * translateObject * rotateblock;
-             block["block"].x_change -= 60.0;
-             block["block"].direction = 2;
-        }  
+    if(key_pressed_left ==1 && blockIdle()){
+        rollBlock(MOVE_LEFT);
         key_pressed_left =0;
     }
 
-    if(level==1){
-        flag =1;
-        gir1=0;
-        gir2=0;
-        for(map<string,Sprite>::iterator it1=tiles.begin();it1!=tiles.end();it1++){
-            string current = it1->first;
-            float XX = block["block"].x_change;
-            float ZZ = block["block"].z_change;
-            
-            if(block["block"].direction == 0){
-                if(tiles[current].x == XX && tiles[current].z == ZZ){
-                    if(current[0] == 'o'){
-                        tileflag =1;
-                        tileX = tiles[current].x;
-                        tileZ = tiles[current].z;
-                        break;
-                    }
-                    else{
-                        flag =0 ;
-                        break;
-                     }
-                }
-                if(XX == -380 && ZZ == -120){
-                    moves=0;
-                    seconds=0;
-                }
-            }    
-            if(block["block"].direction == 1){
-                if(tiles[current].z == ZZ){
-                    if(tiles[current].x + 30.0 == XX || tiles[current].x - 30.0 == XX ||( XX<=-320 && XX>= -440 && ZZ ==-120)){
-                        if(gir1 ==1)
-                            gir2 =1;
-                        else 
-                            gir1 =1;
-                    }
-                    if(gir1 == 1 && gir2 ==1){
-                        flag =0 ; 
-                        break;
-                    }
-                }
-            }
-            if(block["block"].direction == 2){
-                if(tiles[current].x == XX){
-                    if(tiles[current].z + 30.0 == ZZ || tiles[current].z - 30.0 == ZZ || ( ZZ<= -60 && ZZ>= -180 && XX ==-380)){
-                        if(gir1 ==1)
-                            gir2 =1;
-                        else 
-                            gir1 =1;
-                    }
-                    if(gir1 == 1 && gir2 ==1){
-                        flag =0 ; 
-                        break;
-                    }
-                }
-            }
-        }
-        if(switch1==0){
-            float XX = block["block"].x_change;
-            float ZZ = block["block"].z_change;
-            if( XX >= -80 && XX <= -50 && ZZ <=210 && ZZ >= 180)
-                flag =1;
-        }
-        if(switch2==0){
-            if(block["block"].z_change ==0 && block["block"].x_change >= -50 && block["block"].x_change <= 70)
-                flag =1;
-        }
-    }
-        
-    if(level==0){
-        flag =1;
-        gir1=0;
-        gir2=0;
-        for(map<string,Sprite>::iterator it1=ltiles.begin();it1!=ltiles.end();it1++){
-            string current = it1->first;
-            float XX = block["block"].x_change;
-            float ZZ = block["block"].z_change;
-            
-            if(block["block"].direction == 0){
-                if(ltiles[current].x == XX && ltiles[current].z == ZZ){
-                        flag =0 ;
-                        break;
-                }
-                if(XX == -380 && ZZ == -120){
-                   sig=1;
-                   break;
-                }
-            }    
-            if(block["block"].direction == 1){
-                if(ltiles[current].z == ZZ){
-                    if(ltiles[current].x + 30.0 == XX || ltiles[current].x - 30.0 == XX ||( XX<=-320 && XX>= -440 && ZZ ==-120)){
-                        if(gir1 ==1)
-                            gir2 =1;
-                        else 
-                            gir1 =1;
-                    }
-                    if(gir1 == 1 && gir2 ==1){
-                        flag =0 ; 
-                        break;
-                    }
-                }
-            }
-            if(block["block"].direction == 2){
-                if(ltiles[current].x == XX){
-                    if(ltiles[current].z + 30.0 == ZZ || ltiles[current].z - 30.0 == ZZ || ( ZZ<= -60 && ZZ>= -180 && XX ==-380)){
-                        if(gir1 ==1)
-                            gir2 =1;
-                        else 
-                            gir1 =1;
-                    }
-                    if(gir1 == 1 && gir2 ==1){
-                        flag =0 ; 
-                        break;
-                    }
-                }
-            }
-        }
+    if(key_pressed_undo ==1 && blockIdle()){
+        undoMove();
+        key_pressed_undo =0;
     }
 
-    glm::mat4 rotatetile1 = glm::mat4(1.0f);
-    glm::mat4 rotatetile2 = glm::mat4(1.0f);
-    glm::mat4 rotatetile3 = glm::mat4(1.0f);
-
-    if(switch1==0){
-        glm::mat4 translatetile = glm::translate (glm::vec3(-(tiles["tile31"].x_change - 30.0),12,0));
-        glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-        glm::mat4 translatetile1 = glm::translate (glm::vec3(tiles["tile31"].x_change - 30.0,-12,0));
-        rotatetile3 = translatetile1 * rotate * translatetile;
-    }   
-    if(switch2==0){
-        glm::mat4 translatetile = glm::translate (glm::vec3(-(tiles["tile5"].x_change - 30.0),12,0));
-        glm::mat4 rotate = glm::rotate((float)((-90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-        glm::mat4 translatetile1 = glm::translate (glm::vec3(tiles["tile5"].x_change - 30.0,-12,0));
-        rotatetile1 = translatetile1 * rotate * translatetile;
-    }   
-    if(switch2==0){
-        glm::mat4 translatetile = glm::translate (glm::vec3(-(tiles["tile6"].x_change + 30.0),12,0));
-        glm::mat4 rotate = glm::rotate((float)((90.0)*M_PI/180.0f), glm::vec3(0,0,1));
-        glm::mat4 translatetile1 = glm::translate (glm::vec3(tiles["tile6"].x_change + 30.0,-12,0));
-        rotatetile2 = translatetile1 * rotate * translatetile;
+    if(key_pressed_redo ==1 && blockIdle()){
+        redoMove();
+        key_pressed_redo =0;
     }
+
+    updateTweens(tweens, frameTime);
+    animateBlock();
     /* Render your scene */
-    if(level==1){
-        glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(block["block"].x, block["block"].y,block["block"].z)); // glTranslatef
-        
-        glm::mat4 translateblock = glm::translate (glm::vec3(0,-downfall,0)); // glTranslatef
-        if(flag ==1){
-            ObjectTransform=  translateblock * rotateblock * translateObject ;
-            block["block"].y_change -= 3;
-            downfall += 3.0;
+    glm::mat4 ObjectTransform;
+    glm::mat4 translateObject = glm::translate (blocks.pos[0]); // glTranslatef
+    glm::mat4 translateblock = glm::translate (glm::vec3(0,-downfall,0)); // glTranslatef
+    if(flag ==1 && !roll.active){
+        ObjectTransform=  translateblock * rotateblock * translateObject ;
+    }
+    else 
+        ObjectTransform= rotateblock * translateObject ;
+
+    Matrices.model *= ObjectTransform;
+    MVP = VP * Matrices.model; // MVP = p * V * M
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    draw3DObject(blocks.mesh[0]);
+
+    if(blocks.centre[0].y <= -200){
+        int changed = (sig==1 && level==0);
+        clearFall();
+        if(changed){
+            level=1;
+            moves=0;
+            seconds=0;
+            needLevel(level);
         }
-        else 
-            ObjectTransform= rotateblock * translateObject ;
+        resetBlock();
+        settleBlock();
+        if(changed)
+            clearHistory(history, currentSnapshot());
+        else
+            amendHistory(history, currentSnapshot());
+    }
 
-        Matrices.model *= ObjectTransform;
-        MVP = VP * Matrices.model; // MVP = p * V * M
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(block["block"].object);
-        
-        if(block["block"].y_change <= -200){
-            block["block"].x_change =block["block"].x;
-            block["block"].y_change =block["block"].y;
-            block["block"].z_change =block["block"].z;
-            rotateblock = glm::mat4(1.0f);
-            downfall =0;
-            flag =0;
-            block["block"].direction =0;
-            tileflag =0;
-            downtile =0;
-            switch1=0;
-            switch2=0;  
-        }
-
-    }
-
-    if(level==1){
-        for(map<string,Sprite>::iterator it1=tiles.begin();it1!=tiles.end();it1++){
-            string current = it1->first; 
-            glm::mat4 MVP; 
-            Matrices.model = glm::mat4(1.0f);
-
-                /* Render your scene */
-            glm::mat4 ObjectTransform;
-            glm::mat4 translateObject = glm::translate (glm::vec3(tiles[current].x, tiles[current].y,tiles[current].z)); // glTranslatef
-            glm::mat4 translatetile = glm::translate (glm::vec3(0,-downtile,0)); // glTranslatef
-         
-            if(tileflag ==1 && tiles[current].x==tileX && tiles[current].z==tileZ){
-                    ObjectTransform = translatetile * translateObject;
-                    downtile += 5;
-            }
-            else{
-                if(current=="tile5"){
-                    ObjectTransform = rotatetile1 * translateObject;
-                }
-                else if(current=="tile6"){
-                    ObjectTransform = rotatetile2 * translateObject;
-                }
-                else if(current =="tile31"){
-                    ObjectTransform = rotatetile3 * translateObject;
-                }
-                else 
-                    ObjectTransform=translateObject;
-            }
-            Matrices.model *= ObjectTransform;
-            MVP = VP * Matrices.model; // MVP = p * V * M
-            glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-            draw3DObject(tiles[current].object);
-        }
-          
-        for(map<string,Sprite>::iterator it1=switches.begin();it1!=switches.end();it1++){
-            string current = it1->first; 
-            glm::mat4 MVP; 
-            Matrices.model = glm::mat4(1.0f);
-
-                /* Render your scene */
-            glm::mat4 ObjectTransform;
-            glm::mat4 translateObject = glm::translate (glm::vec3(switches[current].x,switches[current].y,switches[current].z)); // glTranslatef
-         
-            ObjectTransform=translateObject;
-            Matrices.model *= ObjectTransform;
-            MVP = VP * Matrices.model; // MVP = p * V * M
-            glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-            draw3DObject(switches[current].object);
-        }
-    }
-   
-    if(level==0){
-        for(map<string,Sprite>::iterator it1=ltiles.begin();it1!=ltiles.end();it1++){
-            string current = it1->first; 
-            glm::mat4 MVP; 
-            Matrices.model = glm::mat4(1.0f);
-
-                /* Render your scene */
-            glm::mat4 ObjectTransform;
-            glm::mat4 translateObject = glm::translate (glm::vec3(ltiles[current].x, ltiles[current].y,ltiles[current].z)); // glTranslatef
-         
-            ObjectTransform=translateObject;
-            
-            Matrices.model *= ObjectTransform;
-            MVP = VP * Matrices.model; // MVP = p * V * M
-            glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-            draw3DObject(ltiles[current].object);
-        }
+    /* the tiles that never move are already in world space */
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &VP[0][0]);
+    for(size_t i=0;i<tileBatches[level].size();i++)
+        draw3DObject(tileBatches[level][i]);
 
-    
+    TileStore &ts = tiles[level];
+    for(size_t i=0;i<ts.mesh.size();i++){
+        glm::mat4 MVP; 
+        Matrices.model = glm::mat4(1.0f);
 
+            /* Render your scene */
         glm::mat4 ObjectTransform;
-        glm::mat4 translateObject = glm::translate (glm::vec3(160.0,60.0,300.0)); // glTranslatef
-        Matrices.model = glm::mat4(1.0f);
-        glm::mat4 translateblock = glm::translate (glm::vec3(0,-downfall,0)); // glTranslatef
-        if(flag ==1){
-            ObjectTransform=  translateblock * rotateblock * translateObject ;
-            block["block"].y_change -= 3;
-            downfall += 3.0;
+        glm::mat4 translateObject = glm::translate (ts.pos[i]); // glTranslatef
+        glm::mat4 translatetile = glm::translate (glm::vec3(0,-ts.drop[i],0)); // glTranslatef
+     
+        if(ts.hinge[i]!=0){
+            float hingeX = ts.pos[i].x + ts.hinge[i]*30.0;
+            glm::mat4 toHinge = glm::translate (glm::vec3(-hingeX,12,0));
+            glm::mat4 rotate = glm::rotate((float)(ts.tilt[i]*M_PI/180.0f), glm::vec3(0,0,1));
+            glm::mat4 fromHinge = glm::translate (glm::vec3(hingeX,-12,0));
+            ObjectTransform = fromHinge * rotate * toHinge * translateObject;
         }
-        else 
-            ObjectTransform= rotateblock * translateObject ;
-
+        else
+            ObjectTransform = translatetile * translateObject;
         Matrices.model *= ObjectTransform;
         MVP = VP * Matrices.model; // MVP = p * V * M
         glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(block["block"].object);
-
-
-        if(block["block"].y_change <= -200){
-            if(sig==1)
-                level=1;
-            else{
-                block["block"].x_change =160;
-                block["block"].y_change =60;
-                block["block"].z_change =300;
-            }
-            rotateblock = glm::mat4(1.0f);
-            downfall =0;
-            flag =0;
-            block["block"].direction =0; 
-        }
+        draw3DObject(ts.mesh[i]);
     }
+      
+    SwitchStore &ss = switches[level];
+    for(size_t i=0;i<ss.mesh.size();i++){
+        glm::mat4 MVP; 
+        Matrices.model = glm::mat4(1.0f);
 
+            /* Render your scene */
+        glm::mat4 translateObject = glm::translate (ss.pos[i]); // glTranslatef
+        Matrices.model *= translateObject;
+        MVP = VP * Matrices.model; // MVP = p * V * M
+        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+        draw3DObject(ss.mesh[i]);
+    }
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1752,129 +4157,669 @@ GLFWwindow* initGLFW (int width, int height) {
     return window;
 }
 
-/* Initialize the OpenGL rendering properties */
+void freeMesh(VAO *vao){
+    if(headless || vao->Shared)     // see bakedGL and tileBuffers
+        return;
+    glDeleteBuffers(1, &vao->VertexBuffer);
+    glDeleteBuffers(1, &vao->ColorBuffer);
+    glDeleteVertexArrays(1, &vao->VertexArrayID);
+}
+
+#define BATCH_TILES 512    // tiles per shared mesh
+#define STAGE_BATCHES 8     // batches the loader stages before they have to be uploaded
+#define UPLOAD_BUDGET 0.002 // seconds of mesh upload per frame while a level streams in
+
+/* The side colours of the tile in a cell */
+void tileFaces(const Level &lv, int cell, COLOR faces[6]){
+    static const COLOR orange = {255.0/255.0,61.0/255.0,0.0/255.0};
+    static const COLOR dark = {178.0/255.0,24.0/255.0,0.0/255.0};
+    static const COLOR grey = {168.0/255.0,168.0/255.0,168.0/255.0};
+    static const COLOR gold = {218.0/255.0,165.0/255.0,32.0/255.0};
+    static const COLOR coingold = {255.0/255.0,223.0/255.0,0.0/255.0};
+    static const COLOR red = {255.0/255.0,2.0/255.0,0.0/255.0};
+    static const COLOR black = {30/255.0,30/255.0,21/255.0};
+    static const COLOR blue = {0,0,1};
+    static const COLOR lightbrown = {95/255.0,63/255.0,32/255.0};
+    static const COLOR darkred = {204/255.0,1/255.0,0/255.0};
+    static const COLOR cratebrown = {153/255.0,102/255.0,0/255.0};
+    static const COLOR skyblue = {0/255.0,0/255.0,127/255.0};
+    static const COLOR lightnknk = {255/255.0,122/255.0,173/255.0};
+    static const COLOR darkpink = {255/255.0,51/255.0,119/255.0};
+    static const COLOR score = {117/255.0,78/255.0,40/255.0};
+
+    int type = lv.cells[cell], odd = ((cell % lv.cols) + (cell / lv.cols)) & 1;
+    COLOR base[6] = { coingold, black, grey, score, odd ? blue : skyblue, gold };
+    memcpy(faces, base, sizeof base);
+    if(type==CELL_FRAGILE){
+        faces[1] = odd ? darkred : dark;
+        faces[4] = odd ? red : orange;
+    }
+    else if(type==CELL_CRUMBLING)
+        faces[4] = odd ? cratebrown : lightbrown;
+    else if(type==CELL_TELEPORT)
+        faces[4] = odd ? darkpink : lightnknk;
+}
+
+/* Tiles that move on their own get a draw each: fragile tiles that drop, bridges, crumbling tiles */
+static bool movingTile(int type){
+    return type==CELL_FRAGILE || type==CELL_BRIDGE || type==CELL_CRUMBLING;
+}
+
+#define SWITCH_PARTS 200    // triangles per switch disc
+
+/* A switch is a gold disc under a smaller one, red on heavy switches and green on soft ones.
+   Disc 1 sits one unit above disc 0 */
+void switchDisc(int type, int disc, COLOR &color, float &radius){
+    static const COLOR coingold = {255.0/255.0,223.0/255.0,0.0/255.0};
+    static const COLOR darkred = {204/255.0,1/255.0,0/255.0};
+    static const COLOR lightgreen = {57/255.0,230/255.0,0/255.0};
+    color = (disc==0) ? coingold : (type==CELL_SWITCH_SOFT) ? lightgreen : darkred;
+    radius = (disc==0) ? 25 : 12;
+}
+
+/* Put a moving tile with its mesh into the level's store */
+int addMovingTile(int lvl, int cell, VAO *mesh){
+    Level &lv = levels[lvl];
+    TileStore &ts = tiles[lvl];
+    int type = lv.cells[cell];
+    ts.pos.push_back(glm::vec3(lv.x0 + (cell % lv.cols)*TILE_SIZE, -6, lv.z0 + (cell / lv.cols)*TILE_SIZE));
+    ts.mesh.push_back(mesh);
+    ts.type.push_back(type);
+    ts.drop.push_back(0);
+    ts.tilt.push_back(0);
+    ts.hinge.push_back(0);
+    ts.gate.push_back(lv.gate[cell]);
+    ts.cell.push_back(cell);
+    int i = ts.mesh.size()-1;
+    if(tileOfCell[lvl].empty())
+        tileOfCell[lvl].assign(lv.cols*lv.rows, -1);
+    tileOfCell[lvl][cell] = i;
+    if(type==CELL_BRIDGE){
+        /* folds up on the side away from the bridge it continues, if any */
+        ts.hinge[i] = (lv.cells[cell-1]==CELL_BRIDGE) ? 1 : -1;
+        ts.tilt[i] = ts.hinge[i]*90.0;
+    }
+    if(lv.gate[cell]>=0)
+        bridges[lvl].push_back(i);
+    return i;
+}
+
+/* A moving tile's mesh is one tile around the origin. The n tiles go up in one buffer and
+   each gets a VAO drawing its own 36 vertices of it, so a board full of fragile tiles costs
+   a buffer per BATCH_TILES tiles, not one per tile */
+void createTiles(int lvl, const int *cells, int n){
+    size_t mark = frameArena.used;
+    GLfloat *vertex = (GLfloat*) arenaAlloc(frameArena, n*108*sizeof(GLfloat));
+    GLfloat *color = (GLfloat*) arenaAlloc(frameArena, n*108*sizeof(GLfloat));
+    for(int i=0;i<n;i++){
+        COLOR faces[6];
+        tileFaces(levels[lvl], cells[i], faces);
+        cubeGeometry(vertex + 108*i, color + 108*i, glm::vec3(0,0,0), TILE_SIZE, 12, TILE_SIZE, faces);
+    }
+    VAO *all = create3DObject(GL_TRIANGLES, 36*n, vertex, color, GL_FILL);
+    frameArena.used = mark;
+    tileBuffers[lvl].push_back(all);
+    for(int i=0;i<n;i++){
+        VAO *mesh = (VAO*) arenaAlloc(*meshArena, sizeof(VAO));
+        *mesh = *all;
+        mesh->NumVertices = 36;
+        mesh->FirstVertex = 36*i;
+        mesh->Shared = true;
+        addMovingTile(lvl, cells[i], mesh);
+    }
+}
+
+/**************************
+ * Baked levels           *
+ **************************/
+
+/* A bake is the meshes of one level ready for the GPU, made offline by --bake so the game
+   does not generate cube vertices while loading:
+
+       BakeHeader | BakeDraw draws[numDraws] | BakeVertex vertices[numVertices] | uint32 indices[numIndices]
+
+   Vertices are position and colour interleaved; the two triangles of a face share theirs.
+   A draw is a range of the index buffer: first every tile that never moves, in world space,
+   then each moving tile and switch disc around its own origin. The header carries the
+   levelHash of the level it was baked from, so a stale bake is ignored */
+#define BAKE_MAGIC "BLXB"
+#define BAKE_VERSION 1
+
+enum { BAKE_STATIC=0, BAKE_TILE, BAKE_SWITCH };
+
+struct BakeHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t levelHash;
+    uint32_t numDraws, numVertices, numIndices;
+    uint32_t reserved;
+};
+typedef struct BakeHeader BakeHeader;
+
+struct BakeVertex {
+    GLfloat pos[3];
+    GLfloat color[3];
+};
+typedef struct BakeVertex BakeVertex;
+
+struct BakeDraw {
+    int32_t kind;               // BAKE_*
+    int32_t cell;               // -1 for the static tiles
+    float x, y, z;              // where a switch disc sits
+    uint32_t firstIndex, numIndices;
+    uint32_t reserved;
+};
+typedef struct BakeDraw BakeDraw;
+
+/* A bake mapped in memory */
+struct BakedLevel {
+    const char *base;
+    size_t size;
+    const BakeHeader *head;
+    const BakeDraw *draws;
+    const BakeVertex *vertices;
+    const uint32_t *indices;
+};
+typedef struct BakedLevel BakedLevel;
+
+/* The GL objects all the draws of a baked level share */
+struct BakedGL {
+    GLuint vertexArray;
+    GLuint buffers[2];          // vertices, indices
+};
+typedef struct BakedGL BakedGL;
+
+BakedGL bakedGL[2];
+
+static const char *levelFiles[2] = { "levels/level0.lvl", "levels/level1.lvl" };
+static const char *levelPackFile = "levels/levels.pack";   // made from levelFiles by make
+static const char *levelBakeFiles[2] = { "levels/level0.bake", "levels/level1.bake" };
+
+/* FNV-1a over what a level's meshes are made from */
+uint64_t levelHash(const Level &lv){
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](const void *p, size_t n){
+        for(size_t i=0;i<n;i++)
+            h = (h ^ ((const unsigned char*)p)[i]) * 1099511628211ull;
+    };
+    mix(&lv.cols, sizeof lv.cols);
+    mix(&lv.rows, sizeof lv.rows);
+    mix(&lv.x0, sizeof lv.x0);
+    mix(&lv.z0, sizeof lv.z0);
+    mix(lv.cells.data(), lv.cells.size());
+    return h;
+}
+
+/* Append n triangle corners as indices, reusing an equal vertex added since 'first' */
+static void bakeTriangles(vector<BakeVertex> &vertices, vector<uint32_t> &indices, size_t first,
+                          const GLfloat *vertex, const GLfloat *color, int n){
+    for(int i=0;i<n;i++){
+        BakeVertex v;
+        memcpy(v.pos, vertex+3*i, sizeof v.pos);
+        memcpy(v.color, color+3*i, sizeof v.color);
+        size_t j = first;
+        while(j<vertices.size() && memcmp(&vertices[j], &v, sizeof v))
+            j++;
+        if(j==vertices.size())
+            vertices.push_back(v);
+        indices.push_back(j);
+    }
+}
+
+/* Bake the meshes of a level into one file */
+bool writeBake(const char *path, const Level &lv){
+    vector<BakeDraw> draws;
+    vector<BakeVertex> vertices;
+    vector<uint32_t> indices;
+    vector<int> own;
+    GLfloat vertex[SWITCH_PARTS*9], colors[SWITCH_PARTS*9];     // a disc, or a tile
+    COLOR faces[6];
+
+    for(int cell=0;cell<lv.cols*lv.rows;cell++){
+        int type = lv.cells[cell];
+        if(type==CELL_EMPTY || type==CELL_GOAL)
+            continue;
+        if(movingTile(type) || type==CELL_SWITCH_HEAVY || type==CELL_SWITCH_SOFT)
+            own.push_back(cell);
+        if(movingTile(type))
+            continue;
+        tileFaces(lv, cell, faces);
+        glm::vec3 at (lv.x0 + (cell % lv.cols)*TILE_SIZE, -6, lv.z0 + (cell / lv.cols)*TILE_SIZE);
+        cubeGeometry(vertex, colors, at, TILE_SIZE, 12, TILE_SIZE, faces);
+        bakeTriangles(vertices, indices, vertices.size(), vertex, colors, 36);
+    }
+    BakeDraw all = { BAKE_STATIC, -1, 0, 0, 0, 0, (uint32_t)indices.size(), 0 };
+    draws.push_back(all);
+
+    for(size_t i=0;i<own.size();i++){
+        int cell = own[i], type = lv.cells[cell];
+        float x = lv.x0 + (cell % lv.cols)*TILE_SIZE, z = lv.z0 + (cell / lv.cols)*TILE_SIZE;
+        if(movingTile(type)){
+            tileFaces(lv, cell, faces);
+            cubeGeometry(vertex, colors, glm::vec3(0,0,0), TILE_SIZE, 12, TILE_SIZE, faces);
+            BakeDraw d = { BAKE_TILE, cell, x, -6, z, (uint32_t)indices.size(), 36, 0 };
+            bakeTriangles(vertices, indices, vertices.size(), vertex, colors, 36);
+            draws.push_back(d);
+            continue;
+        }
+        for(int disc=0;disc<2;disc++){
+            COLOR color;
+            float radius;
+            switchDisc(type, disc, color, radius);
+            circleGeometry(vertex, colors, color, radius, SWITCH_PARTS);
+            BakeDraw d = { BAKE_SWITCH, cell, x, (float)disc, z, (uint32_t)indices.size(), SWITCH_PARTS*3, 0 };
+            bakeTriangles(vertices, indices, vertices.size(), vertex, colors, SWITCH_PARTS*3);
+            draws.push_back(d);
+        }
+    }
+
+    FILE *out = fopen(path, "wb");
+    if(!out){
+        fprintf(stderr, "%s: cannot write\n", path);
+        return false;
+    }
+    BakeHeader head = {};
+    memcpy(head.magic, BAKE_MAGIC, 4);
+    head.version = BAKE_VERSION;
+    head.levelHash = levelHash(lv);
+    head.numDraws = draws.size();
+    head.numVertices = vertices.size();
+    head.numIndices = indices.size();
+    fwrite(&head, sizeof head, 1, out);
+    fwrite(draws.data(), sizeof(BakeDraw), draws.size(), out);
+    fwrite(vertices.data(), sizeof(BakeVertex), vertices.size(), out);
+    fwrite(indices.data(), sizeof(uint32_t), indices.size(), out);
+    bool ok = !ferror(out);
+    ok = (fclose(out)==0) && ok;
+    if(!ok)
+        fprintf(stderr, "%s: write failed\n", path);
+    return ok;
+}
+
+void unmapBake(BakedLevel &bake){
+    if(bake.base)
+        munmap((void*)bake.base, bake.size);
+    bake = BakedLevel();
+}
+
+/* Map the bake of lv and check it; false without a word when there is no bake. The pages
+   are read in here, so the thread that maps it takes the disk reads */
+bool mapBake(const char *path, const Level &lv, BakedLevel &bake){
+    bake = BakedLevel();
+    int fd = open(path, O_RDONLY);
+    if(fd<0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st)<0 || (size_t)st.st_size<sizeof(BakeHeader)){
+        close(fd);
+        fprintf(stderr, "%s: not a baked level\n", path);
+        return false;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(base==MAP_FAILED){
+        fprintf(stderr, "%s: cannot map\n", path);
+        return false;
+    }
+    bake.base = (const char*)base;
+    bake.size = st.st_size;
+    bake.head = (const BakeHeader*)base;
+    const BakeHeader &h = *bake.head;
+    bool ok = memcmp(h.magic, BAKE_MAGIC, 4)==0 && h.version==BAKE_VERSION &&
+              sizeof(BakeHeader) + (size_t)h.numDraws*sizeof(BakeDraw) + (size_t)h.numVertices*sizeof(BakeVertex) +
+              (size_t)h.numIndices*sizeof(uint32_t) == bake.size;
+    if(!ok){
+        fprintf(stderr, "%s: not a baked level\n", path);
+        unmapBake(bake);
+        return false;
+    }
+    if(h.levelHash!=levelHash(lv)){
+        fprintf(stderr, "%s: baked from another version of the level, building its meshes instead\n", path);
+        unmapBake(bake);
+        return false;
+    }
+    bake.draws = (const BakeDraw*)(bake.base + sizeof(BakeHeader));
+    bake.vertices = (const BakeVertex*)(bake.draws + h.numDraws);
+    bake.indices = (const uint32_t*)(bake.vertices + h.numVertices);
+
+    int cells = lv.cols*lv.rows;
+    for(uint32_t i=0;ok && i<h.numDraws;i++){
+        const BakeDraw &d = bake.draws[i];
+        ok = d.firstIndex<=h.numIndices && d.numIndices<=h.numIndices-d.firstIndex &&
+             (d.kind==BAKE_STATIC || (d.cell>=0 && d.cell<cells && (d.kind==BAKE_SWITCH || (d.kind==BAKE_TILE && movingTile(lv.cells[d.cell])))));
+    }
+    for(uint32_t i=0;ok && i<h.numIndices;i++)
+        ok = bake.indices[i]<h.numVertices;
+    if(!ok){
+        fprintf(stderr, "%s: not a baked level\n", path);
+        unmapBake(bake);
+    }
+    return ok;
+}
+
+/* One glBufferData per buffer, then a VAO struct per draw pointing into them */
+void uploadBake(int lvl, const BakedLevel &bake){
+    const BakeHeader &h = *bake.head;
+    BakedGL &gl = bakedGL[lvl];
+    if(!headless){
+        glGenVertexArrays(1, &gl.vertexArray);
+        glGenBuffers(2, gl.buffers);
+        glBindVertexArray(gl.vertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, gl.buffers[0]);
+        glBufferData(GL_ARRAY_BUFFER, h.numVertices*sizeof(BakeVertex), bake.vertices, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(BakeVertex), (void*)offsetof(BakeVertex, pos));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(BakeVertex), (void*)offsetof(BakeVertex, color));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl.buffers[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, h.numIndices*sizeof(uint32_t), bake.indices, GL_STATIC_DRAW);
+    }
+    for(uint32_t i=0;i<h.numDraws;i++){
+        const BakeDraw &d = bake.draws[i];
+        if(d.numIndices==0)
+            continue;
+        VAO *mesh = (VAO*) arenaAlloc(levelArena[lvl], sizeof(VAO));
+        mesh->VertexArrayID = gl.vertexArray;
+        mesh->VertexBuffer = mesh->ColorBuffer = gl.buffers[0];
+        mesh->PrimitiveMode = GL_TRIANGLES;
+        mesh->FillMode = GL_FILL;
+        mesh->NumVertices = d.numIndices;
+        mesh->FirstVertex = 0;
+        mesh->FirstIndex = d.firstIndex;
+        mesh->NumIndices = d.numIndices;
+        mesh->Shared = true;
+        if(d.kind==BAKE_STATIC)
+            tileBatches[lvl].push_back(mesh);
+        else if(d.kind==BAKE_TILE)
+            addMovingTile(lvl, d.cell, mesh);
+        else
+            addSwitchMesh(lvl, glm::vec3(d.x, d.y, d.z), mesh);
+    }
+}
+
+/* A batch of tiles that never move, staged in an arena */
+struct StagedBatch {
+    GLfloat *vertex, *color;
+    int floats;
+};
+typedef struct StagedBatch StagedBatch;
+
+/* A level's meshes on their way to the GPU. Staging only reads the Level, so the loader
+   thread can run it; uploading makes the GL objects and must stay on the main thread.
+   The batches come from 'arena' and it is rewound to 'mark' once they are uploaded */
+struct LevelStaging {
+    int next;                                   // first cell not staged yet
+    bool complete;                              // the whole grid is staged, or the bake mapped
+    Arena *arena;
+    size_t mark;
+    StagedBatch batch[STAGE_BATCHES];
+    int numBatches, batchesDone;                // staged, uploaded
+    vector<int> moving;                         // cells of the moving tiles
+    size_t movingDone;
+    vector<int> own;                            // cells of the switches, which have meshes of their own
+    size_t ownDone;
+    BakedLevel bake;                            // instead of all the above when the level has a bake
+};
+typedef struct LevelStaging LevelStaging;
+
+/* The loader thread stages into its own arena, which holds STAGE_BATCHES batches */
+static char stageArenaMemory[STAGE_BATCHES*2*BATCH_TILES*108*sizeof(GLfloat) + 2*STAGE_BATCHES*16];
+Arena stageArena = { stageArenaMemory, sizeof stageArenaMemory, 0, 0, "stage" };
+
+void beginStaging(LevelStaging &st, Arena &arena){
+    st = LevelStaging();
+    st.arena = &arena;
+    st.mark = arena.used;
+}
+
+/* Write the grid from st.next on into batches, stopping after maxBatches full ones or when
+   all STAGE_BATCHES are in use. True once the whole grid is staged */
+bool stageLevelMeshes(const Level &lv, LevelStaging &st, int maxBatches){
+    int full = 0, cells = lv.cols*lv.rows;
+    for(;st.next<cells && full<maxBatches;st.next++){
+        int cell = st.next, type = lv.cells[cell];
+        if(type==CELL_EMPTY || type==CELL_GOAL)
+            continue;
+        bool batched = !movingTile(type);
+        bool newBatch = st.numBatches==0 || st.batch[st.numBatches-1].floats==BATCH_TILES*108;
+        if(batched && newBatch && st.numBatches==STAGE_BATCHES)
+            break;      // the rest waits until these are uploaded
+        if(!batched)
+            st.moving.push_back(cell);
+        else if(type==CELL_SWITCH_HEAVY || type==CELL_SWITCH_SOFT)
+            st.own.push_back(cell);
+        if(!batched)
+            continue;
+
+        if(newBatch){
+            StagedBatch &b = st.batch[st.numBatches++];
+            b.vertex = (GLfloat*) arenaAlloc(*st.arena, BATCH_TILES*108*sizeof(GLfloat));
+            b.color = (GLfloat*) arenaAlloc(*st.arena, BATCH_TILES*108*sizeof(GLfloat));
+            b.floats = 0;
+        }
+        StagedBatch &b = st.batch[st.numBatches-1];
+        COLOR faces[6];
+        tileFaces(lv, cell, faces);
+        glm::vec3 pos (lv.x0 + (cell % lv.cols)*TILE_SIZE, -6, lv.z0 + (cell / lv.cols)*TILE_SIZE);
+        cubeGeometry(b.vertex + b.floats, b.color + b.floats, pos, TILE_SIZE, 12, TILE_SIZE, faces);
+        b.floats += 108;
+        if(b.floats==BATCH_TILES*108)
+            full++;
+    }
+    st.complete = st.next==cells;
+    return st.complete;
+}
+
+static bool uploadStaged(int lvl, LevelStaging &st, double budget){
+    if(st.bake.base){
+        uploadBake(lvl, st.bake);
+        unmapBake(st.bake);
+        return true;
+    }
+    Level &lv = levels[lvl];
+    double start = wallClock();
+    for(;st.batchesDone<st.numBatches;st.batchesDone++){
+        if(wallClock()-start>budget)
+            return false;
+        const StagedBatch &b = st.batch[st.batchesDone];
+        tileBatches[lvl].push_back(create3DObject(GL_TRIANGLES, b.floats/3, b.vertex, b.color, GL_FILL));
+    }
+    st.numBatches = st.batchesDone = 0;     // all on the GPU, the arena can take the next ones
+    st.arena->used = st.mark;
+    while(st.movingDone<st.moving.size()){
+        if(wallClock()-start>budget)
+            return false;
+        int n = min((size_t)BATCH_TILES, st.moving.size()-st.movingDone);
+        if(n<BATCH_TILES && !st.complete)
+            break;      // part of a buffer, it waits for the tiles still to be staged
+        createTiles(lvl, &st.moving[st.movingDone], n);
+        st.movingDone += n;
+    }
+    for(;st.ownDone<st.own.size();st.ownDone++){
+        if(st.ownDone % 32==0 && wallClock()-start>budget)    // these are small, look at the clock less often
+            return false;
+        int cell = st.own[st.ownDone], type = lv.cells[cell];
+        float x = lv.x0 + (cell % lv.cols)*TILE_SIZE, z = lv.z0 + (cell / lv.cols)*TILE_SIZE;
+        for(int disc=0;disc<2;disc++){
+            COLOR color;
+            float radius;
+            switchDisc(type, disc, color, radius);
+            createCircle(color,x,disc,z,radius,SWITCH_PARTS,lvl,1);
+        }
+    }
+    return true;
+}
+
+/* Turn staged geometry into meshes until 'budget' seconds have passed: the batches first,
+   then the moving tiles a full buffer at a time, then the switches. True when everything
+   staged so far is on the GPU, short of a partly filled buffer of tiles while staging goes on */
+bool uploadLevelMeshes(int lvl, LevelStaging &st, double budget){
+    meshArena = &levelArena[lvl];
+    bool done = uploadStaged(lvl, st, budget);
+    meshArena = &gameArena;
+    return done;
+}
+
+/* Build all the meshes of a level now, staging one batch at a time in frame scratch */
+void buildLevelMeshes(int lvl){
+    LevelStaging st;
+    beginStaging(st, frameArena);
+    bool staged;
+    do {
+        staged = stageLevelMeshes(levels[lvl], st, 1);
+        uploadLevelMeshes(lvl, st, HUGE_VAL);
+    } while(!staged);
+}
+
+/* Free the GL objects of a level's meshes, empty its stores and drop its arena. The rules
+   in levels[lvl] stay */
+bool levelReady[2];         // all meshes of the level are on the GPU
+
+void releaseLevelMeshes(int lvl){
+    for(size_t i=0;i<tiles[lvl].mesh.size();i++){
+        stopTween(tweens, &tiles[lvl].drop[i]);
+        stopTween(tweens, &tiles[lvl].tilt[i]);
+        freeMesh(tiles[lvl].mesh[i]);
+    }
+    for(size_t i=0;i<tileBuffers[lvl].size();i++)
+        freeMesh(tileBuffers[lvl][i]);
+    for(size_t i=0;i<tileBatches[lvl].size();i++)
+        freeMesh(tileBatches[lvl][i]);
+    for(size_t i=0;i<switches[lvl].mesh.size();i++)
+        freeMesh(switches[lvl].mesh[i]);
+    if(bakedGL[lvl].vertexArray){
+        glDeleteBuffers(2, bakedGL[lvl].buffers);
+        glDeleteVertexArrays(1, &bakedGL[lvl].vertexArray);
+    }
+    bakedGL[lvl] = BakedGL();
+    tiles[lvl] = TileStore();
+    tileOfCell[lvl].clear();
+    tileBuffers[lvl].clear();
+    tileBatches[lvl].clear();
+    switches[lvl] = SwitchStore();
+    bridges[lvl].clear();
+    arenaReset(levelArena[lvl]);
+    levelReady[lvl] = false;
+}
+
+/* Meshes of the level after the current one are staged on a loader thread while it is
+   played, then uploaded a little every frame, so changing level does not stall. A level
+   bigger than the stage arena goes in parts: stage, upload, stage the rest */
+struct LevelLoader {
+    int lvl = -1;           // level being streamed in, -1 when none
+    thread worker;
+    atomic<bool> staged;
+    LevelStaging staging;
+    ~LevelLoader(){ if(worker.joinable()) worker.join(); }   // exit() while a level streams in
+};
+typedef struct LevelLoader LevelLoader;
+
+LevelLoader loader;
+
+static void startStaging(){
+    loader.staged = false;
+    loader.worker = thread([]{
+        LevelStaging &st = loader.staging;
+        st.complete = (st.next==0 && mapBake(levelBakeFiles[loader.lvl], levels[loader.lvl], st.bake)) ||
+                      stageLevelMeshes(levels[loader.lvl], st, INT_MAX);
+        loader.staged = true;
+    });
+}
+
+void prefetchLevel(int lvl){
+    if(headless || lvl>=2 || levelReady[lvl] || loader.lvl>=0)
+        return;
+    loader.lvl = lvl;
+    beginStaging(loader.staging, stageArena);
+    startStaging();
+}
+
+/* Called once a frame: upload for a bounded time once the loader thread is done */
+void pumpLevelLoad(double budget){
+    if(loader.lvl<0 || !loader.staged)
+        return;
+    if(loader.worker.joinable())
+        loader.worker.join();
+    if(!uploadLevelMeshes(loader.lvl, loader.staging, budget))
+        return;
+    if(!loader.staging.complete){
+        startStaging();
+        return;
+    }
+    levelReady[loader.lvl] = true;
+    loader.lvl = -1;
+    loader.staging = LevelStaging();
+}
+
+/* The level is about to be drawn: finish streaming it in, or load it on the spot */
+void needLevel(int lvl){
+    if(headless || levelReady[lvl])
+        return;
+    if(loader.lvl==lvl){
+        double t0 = wallClock();
+        while(!levelReady[lvl]){
+            if(loader.worker.joinable())
+                loader.worker.join();
+            loader.staged = true;
+            pumpLevelLoad(HUGE_VAL);
+        }
+        printf("level %d was still loading, waited %.1f ms\n", lvl, (wallClock()-t0)*1000.0);
+    }
+    else{
+        BakedLevel bake;
+        if(mapBake(levelBakeFiles[lvl], levels[lvl], bake)){
+            uploadBake(lvl, bake);
+            unmapBake(bake);
+        }
+        else
+            buildLevelMeshes(lvl);
+        levelReady[lvl] = true;
+    }
+    /* play only moves forward, so a level left behind is not drawn again */
+    for(int l=0;l<2;l++)
+        if(l!=lvl && levelReady[l])
+            releaseLevelMeshes(l);
+}
+
+/* Stop the loader thread and forget what it staged */
+void cancelLevelLoad(){
+    if(loader.worker.joinable())
+        loader.worker.join();
+    unmapBake(loader.staging.bake);
+    loader.lvl = -1;
+    loader.staging = LevelStaging();
+    arenaReset(stageArena);
+}
+
+/* Drops everything initLevels built. The VAO structs live in arenas, so the CPU side goes
+   with a reset per arena; only the GL objects have to be freed one by one */
+void unloadLevels(){
+    cancelLevelLoad();
+    for(int l=0;l<2;l++){
+        releaseLevelMeshes(l);
+        levels[l] = Level();
+    }
+    for(size_t i=0;i<hud.mesh.size();i++)
+        freeMesh(hud.mesh[i]);
+    for(size_t i=0;i<blocks.mesh.size();i++)
+        freeMesh(blocks.mesh[i]);
+    hud = HudStore();
+    blocks = BlockStore();
+    arenaReset(gameArena);
+}
+
+
 /* Add all the models to be created here */
-void initGL (GLFWwindow* window, int width, int height){
+/* Also builds the collision grids, so the headless tools call it without a window */
+void initLevels (){
 
     /* Objects should be created before any other gl function and shaders */
 	// Create the models
     COLOR green1 = {46/255.0,199/255.0,0/255.0};
     COLOR green2 = {85/255.0,255/255.0,66/255.0};
     COLOR green3 = {62/255.0,148/255.0,0/255.0};
-    COLOR orange = {255.0/255.0,61.0/255.0,0.0/255.0}; 
-    COLOR dark = {178.0/255.0,24.0/255.0,0.0/255.0};
-    COLOR grey = {168.0/255.0,168.0/255.0,168.0/255.0};
-    COLOR gold = {218.0/255.0,165.0/255.0,32.0/255.0};
-    COLOR coingold = {255.0/255.0,223.0/255.0,0.0/255.0};
-    COLOR red = {255.0/255.0,2.0/255.0,0.0/255.0};
-    COLOR lightgreen = {57/255.0,230/255.0,0/255.0};
-    COLOR black = {30/255.0,30/255.0,21/255.0};
-    COLOR blue = {0,0,1};
-    COLOR darkbrown = {46/255.0,46/255.0,31/255.0};
-    COLOR lightbrown = {95/255.0,63/255.0,32/255.0};
-    COLOR darkred = {204/255.0,1/255.0,0/255.0};
-    COLOR cratebrown = {153/255.0,102/255.0,0/255.0};
-    COLOR cratebrown1 = {121/255.0,85/255.0,0/255.0};
-    COLOR cratebrown2 = {102/255.0,68/255.0,0/255.0};
-    COLOR skyblue2 = {113/255.0,185/255.0,209/255.0};
-    COLOR skyblue1 = {123/255.0,201/255.0,227/255.0};
-    COLOR skyblue = {0/255.0,0/255.0,127/255.0};
-    COLOR cloudwhite = {229/255.0,255/255.0,255/255.0};
-    COLOR cloudwhite1 = {204/255.0,255/255.0,255/255.0};
-    COLOR lightnknk = {255/255.0,122/255.0,173/255.0};
-    COLOR darkpink = {255/255.0,51/255.0,119/255.0};
-    COLOR white = {255/255.0,255/255.0,255/255.0};
     COLOR score = {117/255.0,78/255.0,40/255.0};
 	// Create and compile our GLSL program from the shaders
 
-
-    createCube("block",green1,green1,green2,green2,green3,green3,-500,60,60,60.0,120.0,60.0,"block");
-    block["block"].direction = 0;
-
-    createCube("otile1",orange,gold,score,grey,coingold,black,-200,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile2",skyblue,gold,score,grey,coingold,black,-140,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile3",skyblue,gold,score,grey,coingold,black,-200,-6,60,60.0,12.0,60.0,"tiles");
-    createCube("tile4",blue,gold,score,grey,coingold,black,-80,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile5",skyblue,gold,score,grey,coingold,black,-20,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile6",blue,gold,score,grey,coingold,black,40,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile7",skyblue,gold,score,grey,coingold,black,100,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile8",blue,gold,score,grey,coingold,black,160,-6,0,60.0,12.0,60.0,"tiles");
-    createCube("tile10",blue,gold,score,grey,coingold,black,100,-6,-60,60.0,12.0,60.0,"tiles");
-    createCube("tile11",skyblue,gold,score,grey,coingold,black,160,-6,-60,60.0,12.0,60.0,"tiles");
-    createCube("tile17",blue,gold,score,grey,coingold,black,160,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("tile18",skyblue,gold,score,grey,coingold,black,160,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile19",skyblue,gold,score,grey,coingold,black,100,-6,240,60.0,12.0,60.0,"tiles");
-    createCircle("switch3",coingold,100,0,240,25,200,"switch",1);
-    createCircle("switch4",darkred,100,1,240,12,200,"switch",1);
-    createCube("tile20",blue,gold,score,grey,coingold,black,100,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile21",skyblue,gold,score,grey,coingold,black,100,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("tile22",skyblue,gold,score,grey,coingold,black,40,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile23",blue,gold,score,grey,coingold,black,40,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("tile24",blue,gold,score,grey,coingold,black,-20,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile25",skyblue,gold,score,grey,coingold,black,-20,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("tile26",skyblue,gold,score,grey,coingold,black,-80,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile27",blue,gold,score,grey,coingold,black,-80,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("tile28",blue,gold,score,grey,coingold,black,-140,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile29",skyblue,gold,score,grey,coingold,black,-140,-6,360,60.0,12.0,60.0,"tiles");
-	createCube("tile30",skyblue,gold,score,grey,coingold,black,-140,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile31",red,gold,score,grey,coingold,black,-80,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("tile31",skyblue,gold,score,grey,coingold,black,-80,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("otile32",orange,gold,score,grey,coingold,dark,-200,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile33",red,gold,score,grey,coingold,darkred,-200,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile34",orange,gold,score,grey,coingold,dark,-260,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile35",red,gold,score,grey,coingold,darkred,-260,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("tile36",skyblue,gold,score,grey,coingold,dark,-320,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile37",red,gold,score,grey,coingold,darkred,-320,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile38",orange,gold,score,grey,coingold,dark,-380,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile39",red,gold,score,grey,coingold,darkred,-380,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("tile40",skyblue,gold,score,grey,coingold,dark,-440,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile41",red,gold,score,grey,coingold,darkred,-440,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile42",orange,gold,score,grey,coingold,dark,-500,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile43",red,gold,score,grey,coingold,darkred,-500,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile44",orange,gold,score,grey,coingold,dark,-560,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile45",red,gold,score,grey,coingold,darkred,-560,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("tile46",skyblue,gold,score,grey,coingold,black,-620,-6,300,60.0,12.0,60.0,"tiles");
-    createCube("otile47",red,gold,score,grey,coingold,darkred,-620,-6,240,60.0,12.0,60.0,"tiles");
-    createCube("otile48",orange,gold,score,grey,coingold,dark,-560,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("tile49",skyblue,gold,score,grey,coingold,black,-500,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("otile50",orange,gold,score,grey,coingold,dark,-440,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("otile51",red,gold,score,grey,coingold,darkred,-380,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("otile52",orange,gold,score,grey,coingold,dark,-320,-6,360,60.0,12.0,60.0,"tiles");
-    createCube("otile53",orange,gold,score,grey,coingold,darkred,-620,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("otile54",red,gold,score,grey,coingold,darkred,-560,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("otile55",orange,gold,score,grey,coingold,darkred,-500,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("otile56",red,gold,score,grey,coingold,darkred,-440,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("tile57",skyblue,gold,score,grey,coingold,darkred,-560,-6,120,60.0,12.0,60.0,"tiles");
-    createCircle("switch1",coingold,-560,0,120,25,200,"switch",1);
-    createCircle("switch2",darkred,-560,1,120,12,200,"switch",1);
-    createCube("tile58",blue,gold,score,grey,coingold,darkred,-500,-6,120,60.0,12.0,60.0,"tiles");
-    createCube("tile59",skyblue,gold,score,grey,coingold,darkred,-440,-6,120,60.0,12.0,60.0,"tiles");
-    createCube("tile60",skyblue,gold,score,grey,coingold,darkred,-500,-6,60,60.0,12.0,60.0,"tiles");
-    createCube("tile61",blue,gold,score,grey,coingold,black,-200,-6,120,60.0,12.0,60.0,"tiles");
-    createCube("otile62",red,gold,score,grey,coingold,black,-200,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("otile63",orange,gold,score,grey,coingold,black,-140,-6,60,60.0,12.0,60.0,"tiles");
-    createCube("otile64",red,gold,score,grey,coingold,black,-140,-6,120,60.0,12.0,60.0,"tiles");
-    createCube("tile65",blue,gold,score,grey,coingold,black,-140,-6,180,60.0,12.0,60.0,"tiles");
-    createCube("tile66",skyblue,gold,score,grey,coingold,black,100,-6,-120,60.0,12.0,60.0,"tiles");
-    createCube("tile67",blue,gold,score,grey,coingold,black,160,-6,-120,60.0,12.0,60.0,"tiles");
-    createCube("tile68",blue,gold,score,grey,coingold,black,100,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile69",skyblue,gold,score,grey,coingold,black,160,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile70",skyblue,gold,score,grey,coingold,black,40,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile71",blue,gold,score,grey,coingold,black,-20,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("otile72",red,gold,score,grey,coingold,black,-80,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("otile73",orange,gold,score,grey,coingold,black,-140,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile74",skyblue,gold,score,grey,coingold,black,-200,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile75",blue,gold,score,grey,coingold,black,-260,-6,-180,60.0,12.0,60.0,"tiles"); 
-    createCube("tile76",skyblue,gold,score,grey,coingold,black,-260,-6,-120,60.0,12.0,60.0,"tiles");
-    createCube("tile77",skyblue,gold,score,grey,coingold,black,-320,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile78",blue,gold,score,grey,coingold,black,-320,-6,-120,60.0,12.0,60.0,"tiles");
-    createCube("tile79",skyblue,gold,score,grey,coingold,black,-320,-6,-60,60.0,12.0,60.0,"tiles");
-    createCube("tile80",blue,gold,score,grey,coingold,black,-380,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile81",blue,gold,score,grey,coingold,black,-380,-6,-60,60.0,12.0,60.0,"tiles");
-    createCube("tile82",skyblue,gold,score,grey,coingold,black,-440,-6,-180,60.0,12.0,60.0,"tiles");
-    createCube("tile83",blue,gold,score,grey,coingold,black,-440,-6,-120,60.0,12.0,60.0,"tiles");
-    createCube("tile84",skyblue,gold,score,grey,coingold,black,-440,-6,-60,60.0,12.0,60.0,"tiles");
-
+    createCube(green1,green1,green2,green2,green3,green3,-500,60,60,60.0,120.0,60.0);
 
     createRectangle1("seg1",score,score,score,score,325,285,2,10,"point1");
     createRectangle1("seg2",score,score,score,score,330,280,10,2,"point1");
@@ -1883,7 +4828,6 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,320,270,10,2,"point1");
     createRectangle1("seg6",score,score,score,score,320,280,10,2,"point1");
     createRectangle1("seg7",score,score,score,score,325,275,2,10,"point1");
-    point1["seg7"].status=0;
 
     createRectangle1("seg1",score,score,score,score,340,285,2,10,"point2");
     createRectangle1("seg2",score,score,score,score,345,280,10,2,"point2");
@@ -1892,7 +4836,6 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,335,270,10,2,"point2");
     createRectangle1("seg6",score,score,score,score,335,280,10,2,"point2");
     createRectangle1("seg7",score,score,score,score,340,275,2,10,"point2");
-    point2["seg7"].status=0;
 
     createRectangle1("seg1",score,score,score,score,355,285,2,10,"point3");
     createRectangle1("seg2",score,score,score,score,360,280,10,2,"point3");
@@ -1901,7 +4844,6 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,350,270,10,2,"point3");
     createRectangle1("seg6",score,score,score,score,350,280,10,2,"point3");
     createRectangle1("seg7",score,score,score,score,355,275,2,10,"point3");
-    point3["seg7"].status=0;
 
     createRectangle1("seg1",score,score,score,score,355,255,2,10,"sec1");
     createRectangle1("seg2",score,score,score,score,360,250,10,2,"sec1");
@@ -1910,8 +4852,6 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,350,240,10,2,"sec1");
     createRectangle1("seg6",score,score,score,score,350,250,10,2,"sec1");
     createRectangle1("seg7",score,score,score,score,355,245,2,10,"sec1");
-    sec1["seg7"].status=0;
-
 
     createRectangle1("seg1",score,score,score,score,340,255,2,10,"sec2");
     createRectangle1("seg2",score,score,score,score,345,250,10,2,"sec2");
@@ -1920,7 +4860,6 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,335,240,10,2,"sec2");
     createRectangle1("seg6",score,score,score,score,335,250,10,2,"sec2");
     createRectangle1("seg7",score,score,score,score,340,245,2,10,"sec2");
-    sec2["seg7"].status=0;
     
     createRectangle1("l1",score,score,score,score,330,250,3,3,"label");
     createRectangle1("l2",score,score,score,score,330,240,3,3,"label");
@@ -1932,8 +4871,6 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,315,240,10,2,"min1");
     createRectangle1("seg6",score,score,score,score,315,250,10,2,"min1");
     createRectangle1("seg7",score,score,score,score,320,245,2,10,"min1");
-    min1["seg7"].status=0;
-
 
     createRectangle1("seg1",score,score,score,score,305,255,2,10,"min2");
     createRectangle1("seg2",score,score,score,score,310,250,10,2,"min2");
@@ -1942,47 +4879,37 @@ void initGL (GLFWwindow* window, int width, int height){
     createRectangle1("seg5",score,score,score,score,300,240,10,2,"min2");
     createRectangle1("seg6",score,score,score,score,300,250,10,2,"min2");
     createRectangle1("seg7",score,score,score,score,305,245,2,10,"min2");
-    min2["seg7"].status=0;
     
-    /*level 1*/
-
-    createCube("tile7",skyblue,gold,score,grey,coingold,black,100,-6,0,60.0,12.0,60.0,"ltiles");
-    createCube("tile8",blue,gold,score,grey,coingold,black,160,-6,0,60.0,12.0,60.0,"ltiles");
-    createCube("tile9",skyblue,gold,score,grey,coingold,black,220,-6,0,60.0,12.0,60.0,"ltiles");
-    createCube("tile10",blue,gold,score,grey,coingold,black,100,-6,-60,60.0,12.0,60.0,"ltiles");
-    createCube("tile11",skyblue,gold,score,grey,coingold,black,160,-6,-60,60.0,12.0,60.0,"ltiles");
-    createCube("tile12",blue,gold,score,grey,coingold,black,220,-6,-60,60.0,12.0,60.0,"ltiles");
-    createCube("tile13",blue,gold,score,grey,coingold,black,220,-6,60,60.0,12.0,60.0,"ltiles");
-    createCube("tile14",skyblue,gold,score,grey,coingold,black,220,-6,120,60.0,12.0,60.0,"ltiles");
-    createCube("tile15",blue,gold,score,grey,coingold,black,220,-6,180,60.0,12.0,60.0,"ltiles");
-    createCube("tile16",skyblue,gold,score,grey,coingold,black,160,-6,180,60.0,12.0,60.0,"ltiles");
-    createCube("tile17",blue,gold,score,grey,coingold,black,160,-6,240,60.0,12.0,60.0,"ltiles");
-    createCube("tile18",skyblue,gold,score,grey,coingold,black,160,-6,300,60.0,12.0,60.0,"ltiles");
-    createCube("tile19",skyblue,gold,score,grey,coingold,black,220,-6,240,60.0,12.0,60.0,"ltiles");
-    createCube("tile66",skyblue,gold,score,grey,coingold,black,100,-6,-120,60.0,12.0,60.0,"ltiles");
-    createCube("tile67",blue,gold,score,grey,coingold,black,160,-6,-120,60.0,12.0,60.0,"ltiles");
-    createCube("tile68",blue,gold,score,grey,coingold,black,100,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile69",skyblue,gold,score,grey,coingold,black,160,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile70",skyblue,gold,score,grey,coingold,black,40,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile71",blue,gold,score,grey,coingold,black,-20,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile72",skyblue,gold,score,grey,coingold,black,-80,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile73",blue,gold,score,grey,coingold,black,-140,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile74",skyblue,gold,score,grey,coingold,black,-200,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile75",blue,gold,score,grey,coingold,black,-260,-6,-180,60.0,12.0,60.0,"ltiles"); 
-    createCube("tile76",skyblue,gold,score,grey,coingold,black,-260,-6,-120,60.0,12.0,60.0,"ltiles");
-    createCube("tile77",skyblue,gold,score,grey,coingold,black,-320,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile78",blue,gold,score,grey,coingold,black,-320,-6,-120,60.0,12.0,60.0,"ltiles");
-    createCube("tile79",skyblue,gold,score,grey,coingold,black,-320,-6,-60,60.0,12.0,60.0,"ltiles");
-    createCube("tile80",blue,gold,score,grey,coingold,black,-380,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile81",blue,gold,score,grey,coingold,black,-380,-6,-60,60.0,12.0,60.0,"ltiles");
-    createCube("tile82",skyblue,gold,score,grey,coingold,black,-440,-6,-180,60.0,12.0,60.0,"ltiles");
-    createCube("tile83",blue,gold,score,grey,coingold,black,-440,-6,-120,60.0,12.0,60.0,"ltiles");
-    createCube("tile84",skyblue,gold,score,grey,coingold,black,-440,-6,-60,60.0,12.0,60.0,"ltiles");
-    block["block"].x_change =160.0;
-    block["block"].y_change= 60.0;
-    block["block"].z_change= 300.0;
+    /* Collision grids and move tables from the level pack, or the level files when there is
+       no pack. Only the first level's meshes are built before the first frame */
+    LevelPack pack;
+    bool packed = openLevelPack(pack, levelPackFile);
+    for(int l=0;l<2;l++){
+        PackLevelView view;
+        bool ok = packed ? packLevel(pack, l, view) && levelFromPack(levels[l], view) : readLevelText(levels[l], levelFiles[l]);
+        if(!ok){
+            fprintf(stderr, "cannot load level %d from %s\n", l, packed ? levelPackFile : levelFiles[l]);
+            exit(EXIT_FAILURE);
+        }
+        if(!compileTransitions(levels[l])){
+            fprintf(stderr, "level %d has more than %u states\n", l, MAX_STATES);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(packed)
+        closeLevelPack(pack);
+    needLevel(level);
+    prefetchLevel(level+1);
+
+    resetBlock();
+    settleBlock();
+    clearHistory(history, currentSnapshot());
+}
 
+/* Initialize the OpenGL rendering properties */
+void initGL (GLFWwindow* window, int width, int height){
 
+    initLevels();
 
     programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
 	// Get a handle for our "MVP" uniform
@@ -2004,14 +4931,496 @@ void initGL (GLFWwindow* window, int width, int height){
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* ./sample2D --solve [bfs|astar|ida] : solve the built-in levels without a window
+   and compare the searches on node count and memory */
+int runSolver(int argc, char** argv){
+    const char *methods[3] = { "bfs", "astar", "ida" };
+    const char *moveNames = "UDLR";
+    int first=0, last=2;
+    for(int i=0;i<3 && argc>0;i++)
+        if(string(argv[0])==methods[i])
+            first = last = i;
+
+    headless =1;
+    initLevels();
+    for(int l=0;l<2;l++){
+        unsigned int start = makeState(levels[l],levels[l].start,STANDING,0);
+        for(int m=first;m<=last;m++){
+            SolveResult res;
+            solveLevel(levels[l],start,m,res);
+            printf("level %d  %-5s  moves %4d  expanded %9lu  generated %9lu  peak %10lu bytes  %9.3f ms\n",
+                   l, methods[m], res.length, res.expanded, res.generated, (unsigned long)res.peakBytes, res.ms);
+        }
+        SolveResult res;
+        solveLevel(levels[l],start,SOLVE_ASTAR,res);
+        printf("level %d  solution ", l);
+        for(size_t i=0;i<res.path.size();i++)
+            putchar(moveNames[res.path[i]]);
+        printf("\n");
+    }
+    return 0;
+}
+
+/* ./sample2D --generate <count> <dir> [seed] [threads] : write solver-checked levels to dir */
+int runGenerator(int argc, char** argv){
+    if(argc<2){
+        fprintf(stderr, "usage: --generate <count> <dir> [seed] [threads]\n");
+        return 1;
+    }
+    int count = atoi(argv[0]);
+    string dir = argv[1];
+    unsigned long seed = (argc>2) ? strtoul(argv[2], NULL, 10) : 1;
+    int threads = (argc>3) ? atoi(argv[3]) : (int)thread::hardware_concurrency();
+    GenParams params = { 8, 16, 6, 12, 12, 2, 0.12 };
+
+    mkdir(dir.c_str(), 0755);
+    double t0 = wallClock();
+    vector<GenLevel> out;
+    generateLevels(count, seed, max(threads,1), params, out);
+    double elapsed = wallClock() - t0;
+
+    for(size_t i=0;i<out.size();i++){
+        char name[64], comment[128];
+        snprintf(name, sizeof(name), "/gen_%lu.lvl", out[i].seed);
+        snprintf(comment, sizeof(comment), "seed %lu moves %d branching %.2f reachable %lu",
+                 out[i].seed, out[i].moves, out[i].stats.branching, out[i].stats.reachable);
+        FILE *f = fopen((dir + name).c_str(), "w");
+        if(!f){
+            fprintf(stderr, "%s%s: cannot write\n", dir.c_str(), name);
+            return 1;
+        }
+        writeLevelText(out[i].level, f, comment);
+        fclose(f);
+        printf("%s\n", comment);
+    }
+    printf("%d levels in %.2f s on %d threads\n", (int)out.size(), elapsed, max(threads,1));
+    return 0;
+}
+
+/* Files named on the command line; directories contribute their files ending in ext, sorted,
+   and a level pack contributes 'file.pack:n' for each of its levels */
+void expandPaths(int argc, char** argv, const string &ext, vector<string> &paths){
+    for(int i=0;i<argc;i++){
+        string arg = argv[i];
+        LevelPack pack;
+        if(arg.size()>5 && arg.compare(arg.size()-5, 5, ".pack")==0 && openLevelPack(pack, argv[i])){
+            for(uint32_t n=0;n<pack.count;n++)
+                paths.push_back(arg + ":" + to_string(n));
+            closeLevelPack(pack);
+            continue;
+        }
+        DIR *dir = opendir(argv[i]);
+        if(!dir){
+            paths.push_back(argv[i]);
+            continue;
+        }
+        vector<string> found;
+        struct dirent *entry;
+        while((entry = readdir(dir))!=NULL){
+            string name = entry->d_name;
+            if(name.size()>ext.size() && name.compare(name.size()-ext.size(), ext.size(), ext)==0)
+                found.push_back(string(argv[i]) + "/" + name);
+        }
+        closedir(dir);
+        sort(found.begin(), found.end());
+        paths.insert(paths.end(), found.begin(), found.end());
+    }
+}
+
+/* Levels named on the command line, or the two built-in levels when there are none */
+bool loadLevelArgs(int argc, char** argv, vector<Level> &out, vector<string> &names){
+    if(argc==0){
+        headless =1;
+        initLevels();
+        for(int l=0;l<2;l++){
+            out.push_back(levels[l]);
+            names.push_back(l==0 ? "level0" : "level1");
+        }
+        return true;
+    }
+    vector<string> paths;
+    expandPaths(argc, argv, ".lvl", paths);
+    out.resize(paths.size());
+    for(size_t i=0;i<paths.size();i++){
+        if(!readLevelPath(out[i], paths[i]))
+            return false;
+        if(!compileTransitions(out[i])){
+            fprintf(stderr, "%s: more than %u states\n", paths[i].c_str(), MAX_STATES);
+            return false;
+        }
+        names.push_back(paths[i]);
+    }
+    return true;
+}
+
+/* ./sample2D --playtest <bots> [greedy|softmax] [seed] [level.lvl ...] : difficulty report */
+int runPlaytest(int argc, char** argv){
+    if(argc<1){
+        fprintf(stderr, "usage: --playtest <bots> [greedy|softmax] [seed] [level.lvl ...]\n");
+        return 1;
+    }
+    int bots = atoi(argv[0]);
+    BotParams params = { AGENT_GREEDY, 0.15, 1.0, 3.0, 2000 };
+    unsigned long seed = 1;
+    int used = 1;
+    if(argc>used && (string(argv[used])=="greedy" || string(argv[used])=="softmax"))
+        params.agent = (string(argv[used++])=="softmax") ? AGENT_SOFTMAX : AGENT_GREEDY;
+    if(argc>used && isdigit(argv[used][0]))
+        seed = strtoul(argv[used++], NULL, 10);
+
+    vector<Level> lv;
+    vector<string> names;
+    if(!loadLevelArgs(argc-used, argv+used, lv, names))
+        return 1;
+    int threads = max((int)thread::hardware_concurrency(), 1);
+
+    printf("%-24s %-7s %6s %8s %10s %10s %8s %8s %8s\n", "level", "agent", "bots", "fail%", "falls/bot", "breaks/bot", "optimal", "median", "p90");
+    for(size_t i=0;i<lv.size();i++){
+        BotReport rep;
+        SolveResult best;
+        solveLevel(lv[i], makeState(lv[i], lv[i].start, STANDING, 0), SOLVE_ASTAR, best);
+        playtestLevel(lv[i], bots, seed + i, threads, params, rep);
+        int median = rep.solveMoves.empty() ? -1 : rep.solveMoves[rep.solveMoves.size()/2];
+        int p90 = rep.solveMoves.empty() ? -1 : rep.solveMoves[rep.solveMoves.size()*9/10];
+        printf("%-24s %-7s %6d %8.2f %10.2f %10.2f %8d %8d %8d\n", names[i].c_str(),
+               params.agent==AGENT_SOFTMAX ? "softmax" : "greedy", rep.bots,
+               100.0*(rep.bots - rep.solved)/max(rep.bots,1),
+               (double)rep.falls/max(rep.bots,1), (double)rep.breaks/max(rep.bots,1),
+               best.length, median, p90);
+    }
+    return 0;
+}
+
+
+/* ./sample2D --validate [level.lvl|dir ...] : lint a level pack, one JSON line per level.
+   Exits with 1 if any level has errors. */
+int runValidator(int argc, char** argv){
+    vector<string> paths;
+    expandPaths(argc, argv, ".lvl", paths);
+    vector<LintReport> reports(paths.empty() ? 2 : paths.size());
+    double t0 = wallClock();
+
+    if(paths.empty()){
+        headless =1;
+        initLevels();
+        for(int l=0;l<2;l++){
+            reports[l].name = (l==0) ? "level0" : "level1";
+            validateLevel(levels[l], reports[l]);
+        }
+    }
+    else{
+        atomic<size_t> next(0);
+        vector<thread> workers;
+        int threads = max((int)thread::hardware_concurrency(), 1);
+        for(int w=0;w<threads;w++){
+            workers.push_back(thread([&]{
+                for(size_t i=next++;i<paths.size();i=next++){
+                    Level lv;
+                    reports[i].name = paths[i];
+                    reports[i].moves = -1;
+                    reports[i].reachable = 0;
+                    if(!readLevelPath(lv, paths[i]) || !compileTransitions(lv)){
+                        LintIssue issue = { "parse-error", -1, -1, -1 };
+                        reports[i].errors.push_back(issue);
+                        continue;
+                    }
+                    validateLevel(lv, reports[i]);
+                }
+            }));
+        }
+        for(size_t w=0;w<workers.size();w++)
+            workers[w].join();
+    }
+
+    int failed = 0, warnings = 0;
+    for(size_t i=0;i<reports.size();i++){
+        printLintReport(reports[i]);
+        failed += !reports[i].errors.empty();
+        warnings += reports[i].warnings.size();
+    }
+    fprintf(stderr, "%d levels, %d with errors, %d warnings in %.1f ms\n", (int)reports.size(), failed, warnings, (wallClock()-t0)*1000.0);
+    return failed ? 1 : 0;
+}
+
+/* ./sample2D --replay <file.blxr|dir ...> : re-run recorded sessions headless and check
+   that each one ends in the recorded level and state */
+int runReplays(int argc, char** argv){
+    vector<string> paths;
+    expandPaths(argc, argv, ".blxr", paths);
+    headless =1;
+    initLevels();
+
+    int bad = 0;
+    unsigned long events = 0;
+    double t0 = wallClock();
+    for(size_t i=0;i<paths.size();i++){
+        Replay r;
+        int finalLevel;
+        unsigned int finalState;
+        if(!loadReplay(r, paths[i].c_str()) || r.level<0 || r.level>1){
+            printf("%s: unreadable\n", paths[i].c_str());
+            bad++;
+            continue;
+        }
+        events += r.count;
+        if(!playReplay(r, finalLevel, finalState)){
+            printf("%s: corrupt event stream\n", paths[i].c_str());
+            bad++;
+        }
+        else if(finalLevel!=r.finalLevel || finalState!=r.finalState){
+            printf("%s: MISMATCH after %lu moves (level %d state %u, recorded level %d state %u)\n", paths[i].c_str(),
+                   r.count, finalLevel, finalState, r.finalLevel, r.finalState);
+            bad++;
+        }
+    }
+    double elapsed = wallClock() - t0;
+    printf("%d replays, %lu moves, %d failed, %.1f ms\n", (int)paths.size(), events, bad, elapsed*1000.0);
+    return bad ? 1 : 0;
+}
+
+/* ./sample2D --pack <out.pack> <level.lvl|dir|pack ...> : write the levels into one pack, then
+   map it back, check every level against its source and time the jumps to random levels */
+int runPack(int argc, char** argv){
+    if(argc<2){
+        fprintf(stderr, "usage: --pack <out.pack> <level.lvl|dir|pack ...>\n");
+        return 1;
+    }
+    vector<string> paths;
+    expandPaths(argc-1, argv+1, ".lvl", paths);
+    vector<Level> lvls(paths.size());
+    size_t sourceBytes = 0;
+    for(size_t i=0;i<paths.size();i++){
+        if(!readLevelPath(lvls[i], paths[i]))
+            return 1;
+        struct stat st;
+        if(stat(paths[i].c_str(), &st)==0)
+            sourceBytes += st.st_size;
+    }
+    if(!writeLevelPack(argv[0], lvls))
+        return 1;
+
+    LevelPack pack;
+    double t0 = wallClock();
+    if(!openLevelPack(pack, argv[0]))
+        return 1;
+    double openUs = (wallClock()-t0)*1e6;
+    for(uint32_t n=0;n<pack.count;n++){
+        PackLevelView view;
+        Level lv;
+        if(!packLevel(pack, n, view) || !levelFromPack(lv, view) || lv.cells!=lvls[n].cells || lv.gate!=lvls[n].gate ||
+           lv.trigger!=lvls[n].trigger || lv.link!=lvls[n].link || lv.start!=lvls[n].start || lv.goal!=lvls[n].goal){
+            fprintf(stderr, "%s: level %u does not match %s\n", argv[0], n, paths[n].c_str());
+            return 1;
+        }
+    }
+    /* random jumps, decoding each grid into one scratch buffer */
+    size_t most = 0;
+    int rle = 0;
+    for(uint32_t n=0;n<pack.count;n++){
+        PackLevelView view;
+        packLevel(pack, n, view);
+        most = max(most, (size_t)view.head->cols*view.head->rows);
+        rle += view.head->encoding==PACK_CELLS_RLE;
+    }
+    vector<unsigned char> scratch(most);
+    mt19937 rng(1);
+    int jumps = 100000;
+    unsigned long sum = 0;
+    t0 = wallClock();
+    for(int j=0;j<jumps && pack.count;j++){
+        PackLevelView view;
+        if(packLevel(pack, rng() % pack.count, view) && decodeCells(view, &scratch[0]))
+            sum += scratch[view.head->start];
+    }
+    double jumpUs = (wallClock()-t0)*1e6/jumps;
+    printf("%u levels (%d run-length, %d bit-packed), %zu bytes (%zu in the sources): map %.1f us, "
+           "jump to and decode a level %.3f us (%lu)\n",
+           pack.count, rle, (int)pack.count-rle, pack.size, sourceBytes, openUs, jumpUs, sum % 10);
+    closeLevelPack(pack);
+    return 0;
+}
+
+/* Bytes a mesh made at run time sends to the GPU: positions and colours */
+static size_t meshBytes(const VAO *mesh){
+    return (size_t)mesh->NumVertices*6*sizeof(GLfloat);
+}
+
+/* ./sample2D --bake <out.bake> <level.lvl|pack:n> : bake the meshes of a level, then compare
+   loading the bake with generating the meshes, best of 5 runs without a window */
+int runBake(int argc, char** argv){
+    if(argc<2){
+        fprintf(stderr, "usage: --bake <out.bake> <level.lvl|pack:n>\n");
+        return 1;
+    }
+    Level lv;
+    if(!readLevelPath(lv, argv[1]) || !writeBake(argv[0], lv))
+        return 1;
+
+    headless =1;
+    double generateMs = 1e9, bakedMs = 1e9;
+    size_t generatedBytes = 0, bakedBytes = 0;
+    int meshes = 0, buffers = 0, draws = 0;
+    for(int run=0;run<5;run++){
+        unloadLevels();
+        levels[0] = lv;
+        double t0 = wallClock();
+        buildLevelMeshes(0);
+        generateMs = min(generateMs, (wallClock()-t0)*1000.0);
+        generatedBytes = 0;
+        for(size_t i=0;i<tileBatches[0].size();i++)
+            generatedBytes += meshBytes(tileBatches[0][i]);
+        for(size_t i=0;i<tiles[0].mesh.size();i++)
+            generatedBytes += meshBytes(tiles[0].mesh[i]);
+        for(size_t i=0;i<switches[0].mesh.size();i++)
+            generatedBytes += meshBytes(switches[0].mesh[i]);
+        meshes = tileBatches[0].size() + tiles[0].mesh.size() + switches[0].mesh.size();
+        buffers = 2*(tileBatches[0].size() + tileBuffers[0].size() + switches[0].mesh.size());
+
+        unloadLevels();
+        levels[0] = lv;
+        t0 = wallClock();
+        BakedLevel bake;
+        if(!mapBake(argv[0], levels[0], bake))
+            return 1;
+        uploadBake(0, bake);
+        bakedMs = min(bakedMs, (wallClock()-t0)*1000.0);
+        bakedBytes = bake.size - sizeof(BakeHeader) - bake.head->numDraws*sizeof(BakeDraw);
+        draws = bake.head->numDraws;
+        unmapBake(bake);
+    }
+    unloadLevels();
+    printf("%s: %d draws, %zu bytes for the GPU in 2 buffers; generated: %d meshes, %zu bytes in %d buffers\n",
+           argv[0], draws, bakedBytes, meshes, generatedBytes, buffers);
+    printf("load %.3f ms baked, %.3f ms generated (CPU side, no GL context)\n", bakedMs, generateMs);
+    return 0;
+}
+
+/* ./sample2D --progress : print the saved progress without changing the store */
+int runProgress(int argc, char** argv){
+    int log = open(PROGRESS_DIR "/progress.log", O_RDONLY);
+    if(log<0){
+        printf("no progress saved yet\n");
+        return 0;
+    }
+    ProgressStats stats[PROGRESS_LEVELS];
+    uint64_t seq;
+    readProgress(log, stats, seq, false);
+    close(log);
+    printProgress(stats);
+    printf("%lu records\n", (unsigned long)seq);
+    return 0;
+}
+
+/* ./sample2D --load-bench [cols] [rows] [runs] : parse a random cols x rows level (1000 x 1000
+   by default) from memory, build its transition table as the game does, then its meshes
+   without uploading them; best of 'runs'. Fails when parsing and the table take 100 ms or more */
+int runLoadBench(int argc, char** argv){
+    int cols = (argc>0) ? atoi(argv[0]) : 1000;
+    int rows = (argc>1) ? atoi(argv[1]) : 1000;
+    int runs = (argc>2) ? atoi(argv[2]) : 5;
+    if(cols<2 || rows<1 || runs<1){
+        fprintf(stderr, "usage: --load-bench [cols] [rows] [runs]\n");
+        return 1;
+    }
+
+    /* mostly tiles, some fragile ones and holes in the floor; start top left, hole bottom right */
+    mt19937 rng(1);
+    string text = "grid " + to_string(cols) + " " + to_string(rows) + "\n";
+    for(int r=0;r<rows;r++){
+        for(int c=0;c<cols;c++){
+            unsigned int roll = rng() % 10;
+            text += (roll<7) ? '#' : (roll<8) ? 'o' : '.';
+        }
+        text += '\n';
+    }
+    text[text.find('\n')+1] = '#';
+    text[text.size()-2] = 'H';
+    text += "start 0 0\nhole " + to_string(cols-1) + " " + to_string(rows-1) + "\n";
+
+    headless =1;
+    double parseMs = 1e9, rulesMs = 1e9, loadMs = 1e9, meshMs = 1e9;
+    vector<char> buf(text.size()+1);
+    for(int run=0;run<runs;run++){
+        unloadLevels();
+        memcpy(&buf[0], text.c_str(), text.size()+1);
+        double t0 = wallClock();
+        if(!parseLevelText(levels[0], &buf[0], text.size(), "bench"))
+            return 1;
+        double t1 = wallClock();
+        if(!compileTransitions(levels[0])){
+            fprintf(stderr, "bench: %dx%d has more than %u states\n", cols, rows, MAX_STATES);
+            return 1;
+        }
+        double t2 = wallClock();
+        buildLevelMeshes(0);
+        double t3 = wallClock();
+        parseMs = min(parseMs, (t1-t0)*1000.0);
+        rulesMs = min(rulesMs, (t2-t1)*1000.0);
+        loadMs = min(loadMs, (t2-t0)*1000.0);
+        meshMs = min(meshMs, (t3-t2)*1000.0);
+    }
+    printf("%dx%d level, %.1f MB: load %.1f ms = parse %.1f ms (%.0f MB/s) + transitions %.1f ms (%zu states)\n",
+           cols, rows, text.size()/1e6, loadMs, parseMs, text.size()/1e3/parseMs, rulesMs, levels[0].table.size()/4);
+    printf("meshes %.1f ms: %d batches, %d moving tiles in %d buffers\n",
+           meshMs, (int)tileBatches[0].size(), (int)tiles[0].mesh.size(), (int)tileBuffers[0].size());
+
+    /* the same grid as a pack would store it, decoded back into the level */
+    Level &lv = levels[0];
+    int cells = lv.cols*lv.rows;
+    vector<unsigned char> packed[2];
+    encodeCellsRLE(&lv.cells[0], cells, packed[PACK_CELLS_RLE]);
+    encodeCellsBits(&lv.cells[0], cells, packed[PACK_CELLS_BITS]);
+    vector<unsigned char> grid(cells);
+    for(int e=PACK_CELLS_RLE;e<=PACK_CELLS_BITS;e++){
+        PackLevel pl = PackLevel();
+        pl.cols = lv.cols;
+        pl.rows = lv.rows;
+        pl.encoding = e;
+        pl.cellBytes = packed[e].size();
+        PackLevelView view = { &pl, &packed[e][0], NULL, NULL, NULL, NULL };
+        double decodeMs = 1e9;
+        for(int run=0;run<runs;run++){
+            double t0 = wallClock();
+            if(!decodeCells(view, &grid[0]) || grid!=lv.cells)
+                return 1;
+            decodeMs = min(decodeMs, (wallClock()-t0)*1000.0);
+        }
+        printf("%s: %zu bytes for %d cells, decode %.2f ms (%.0f MB/s of grid)\n",
+               (e==PACK_CELLS_RLE) ? "run-length" : "bit-packed", packed[e].size(), cells, decodeMs, cells/1e3/decodeMs);
+    }
+    return loadMs<100 ? 0 : 1;
+}
+
 int main (int argc, char** argv)
 {
 	int width = 900;
 	int height = 700;
 
+    if(argc>1 && string(argv[1])=="--solve")
+        return runSolver(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--generate")
+        return runGenerator(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--playtest")
+        return runPlaytest(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--validate")
+        return runValidator(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--replay")
+        return runReplays(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--pack")
+        return runPack(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--load-bench")
+        return runLoadBench(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--bake")
+        return runBake(argc-2, argv+2);
+    if(argc>1 && string(argv[1])=="--progress")
+        return runProgress(argc-2, argv+2);
+
+    double launched = wallClock();
     GLFWwindow* window = initGLFW(width, height);
 
 	initGL (window, width, height);
+    startRecording();
+    openProgress();
 
     audio_init();
     double last_update_time = glfwGetTime(), current_time;
@@ -2021,17 +5430,24 @@ int main (int argc, char** argv)
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
 
+        allocFrameBegin();
+        arenaReset(frameArena);
         /*if(flag ==1)
             gameover =1;*/
-        audio_play();
         // OpenGL Draw commands
+        frameTime = glfwGetTime();
         draw(window, width, height);
 
         // Swap Frame Buffer in double buffering
         glfwSwapBuffers(window);
+        if(frameCount==0)
+            printf("first frame %.1f ms after start\n", (wallClock()-launched)*1000.0);
 
         // Poll for Keyboard and mouse events
         glfwPollEvents();
+        pumpLevelLoad(UPLOAD_BUDGET);
+        allocFrameEnd(frameCount);
+        frameCount++;
 
         // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
         current_time = glfwGetTime(); // Time in seconds
@@ -2041,6 +5457,9 @@ int main (int argc, char** argv)
         }
     }
 
+    saveSessionReplay();
+    closeProgress();
+    unloadLevels();
     audio_close();
     glfwTerminate();
     exit(EXIT_SUCCESS);